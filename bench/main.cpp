@@ -0,0 +1,756 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <thread>
+#include "aml.h"
+#include "array.h"
+#include "scheduler.h"
+
+namespace aml_n = aml::aml_n;
+namespace array_n = aml::array_n;
+namespace code_n = aml::code_n;
+namespace image_n = aml::image_n;
+namespace stmt_n = aml::stmt_n;
+namespace token_n = aml::token_n;
+
+
+
+// allocations of the whole process, the library included, are counted by the replaced operator new
+static std::atomic<size_t> allocations = {};
+
+// gcc sees the malloc behind the replaced operator new and warns on the matching free
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  operator delete(ptr);
+}
+
+#pragma GCC diagnostic pop
+
+
+
+static const std::string source_recursion = R"AML(
+  (#include "aml/standard/standard.aml")
+
+  (defn fib
+    (if
+      (call
+        (func <)
+        (arg 1)
+        (int 2))
+      (arg 1)
+      (call
+        (func +)
+        (call
+          (func fib)
+          (call
+            (func -)
+            (arg 1)
+            (int 1)))
+        (call
+          (func fib)
+          (call
+            (func -)
+            (arg 1)
+            (int 2))))))
+
+  (call
+    (func fib)
+    (int 20))
+)AML";
+
+static const std::string source_factorial = R"AML(
+  (#include "aml/standard/standard.aml")
+
+  (defn fact
+    (if
+      (call
+        (func <)
+        (arg 1)
+        (int 2))
+      (int 1)
+      (call
+        (func *)
+        (arg 1)
+        (call
+          (func fact)
+          (call
+            (func -)
+            (arg 1)
+            (int 1))))))
+
+  (defn repeat
+    (if
+      (call
+        (func <)
+        (arg 1)
+        (int 1))
+      (arg 2)
+      (call
+        (func repeat)
+        (call
+          (func -)
+          (arg 1)
+          (int 1))
+        (call
+          (func fact)
+          (int 20)))))
+
+  (call
+    (func repeat)
+    (int 2000)
+    (int 0))
+)AML";
+
+
+
+// defns with distinct names and a comment, repeated up to the requested size
+static std::string generate_source(size_t size) {
+  std::string code = "(#include \"aml/standard/standard.aml\")\n\n";
+  for (size_t i{}; code.size() < size; ++i) {
+    auto n = std::to_string(i);
+    code += "; defn " + n + "\n"
+      "(defn func_" + n + "\n"
+      "  (if\n"
+      "    (call (func <) (arg 1) (int -" + n + "))\n"
+      "    (call (func func_" + n + ") (call (func +) (arg 1) (int 1)) (arg 2))\n"
+      "    (block\n"
+      "      (defvar value_" + n + " (syscall (int 202) (arg 2) (int " + n + ")))\n"
+      "      (var value_" + n + "))))\n\n";
+  }
+  return code + "(call (func func_0) (int 1) (int 2))\n";
+}
+
+
+
+// few defns with deep bodies, to measure the parser without the environment
+static std::string generate_expr(size_t depth, size_t& seed) {
+  if (!depth)
+    return (seed++ % 2) ? "(arg 1)" : "(int " + std::to_string(seed) + ")";
+
+  switch (seed++ % 4) {
+    case 0:  return "(if " + generate_expr(depth - 1, seed) + " " + generate_expr(depth - 1, seed) + " (int 0))";
+    case 1:  return "(call (func +) " + generate_expr(depth - 1, seed) + " " + generate_expr(depth - 1, seed) + ")";
+    case 2:  return "(block (defvar v " + generate_expr(depth - 1, seed) + ") (var v))";
+    default: return "(syscall (int 200) " + generate_expr(depth - 1, seed) + " " + generate_expr(depth - 1, seed) + ")";
+  }
+}
+
+static std::string generate_tree(size_t size) {
+  std::string code = "(#include \"aml/standard/standard.aml\")\n\n";
+  size_t seed = {};
+  for (size_t i{}; code.size() < size; ++i) {
+    code += "(defn tree_" + std::to_string(i) + "\n  " + generate_expr(14, seed) + ")\n\n";
+  }
+  return code + "(call (func tree_0) (int 1))\n";
+}
+
+
+
+// many small defns, each resolving earlier functions by name
+static std::string generate_funcs(size_t count) {
+  std::string code = "(#include \"aml/standard/standard.aml\")\n\n(defn f_0 (arg 1))\n";
+  for (size_t i{1}; i < count; ++i) {
+    code += "(defn f_" + std::to_string(i) + " (call (func +)"
+      " (call (func f_" + std::to_string(i / 2) + ") (arg 1))"
+      " (call (func f_" + std::to_string(i - 1) + ") (int 1))))\n";
+  }
+  return code + "(call (func f_0) (int 1))\n";
+}
+
+
+
+// a long block of defvars, each reading the previous ones, and a nested block chain
+static std::string generate_chain(size_t count, size_t depth) {
+  std::string code = "(#include \"aml/standard/standard.aml\")\n\n(defn chain\n  (block\n    (defvar v_0 (arg 1))\n";
+  for (size_t i{1}; i < count; ++i) {
+    code += "    (defvar v_" + std::to_string(i) + " (call (func +) (var v_" + std::to_string(i - 1) + ")"
+      " (var v_" + std::to_string(i / 2) + ")))\n";
+  }
+  code += "    (call (func -) (var v_" + std::to_string(count - 1) + ") (var v_" + std::to_string(count - 2) + "))))\n\n";
+
+  code += "(defn nested\n";
+  for (size_t i{}; i < depth; ++i)
+    code += "(block (defvar n_" + std::to_string(i) + " (call (func +) (arg 1) (int " + std::to_string(i) + "))) ";
+  code += "(var n_" + std::to_string(depth - 1) + ")";
+  code += std::string(depth, ')') + ")\n\n";
+  return code + "(call (func +) (call (func chain) (int 1)) (call (func nested) (int 1)))\n";
+}
+
+
+
+// files including several of the previous ones, the dedup set keeps each one parsed once
+static std::string generate_includes(const std::filesystem::path& dir, size_t files, size_t defns) {
+  std::filesystem::create_directories(dir);
+  auto standard = (std::filesystem::path(AML_SOURCE_DIR) / "aml/standard/standard.aml").string();
+
+  for (size_t i{}; i < files; ++i) {
+    auto n = std::to_string(i);
+    std::string code = "(#include \"" + standard + "\")\n";
+    for (size_t k = 1; k <= 3 && k <= i; ++k)
+      code += "(#include \"module_" + std::to_string(i - k) + ".aml\")\n";
+    for (size_t j{}; j < defns; ++j) {
+      auto name = "m_" + n + "_" + std::to_string(j);
+      auto prev = i ? "m_" + std::to_string(i - 1) + "_" + std::to_string(j) : std::string("+");
+      code += "(defn " + name + " (call (func " + prev + ") (arg 1) (int " + std::to_string(j) + ")))\n";
+    }
+    aml::utils_n::str_to_file(code, (dir / ("module_" + n + ".aml")).string());
+  }
+
+  std::string code;
+  for (size_t i{}; i < files; ++i)
+    code += "(#include \"module_" + std::to_string(i) + ".aml\")\n";
+  return code + "(call (func m_" + std::to_string(files - 1) + "_0) (int 1) (int 2))\n";
+}
+
+
+
+struct sample_t {
+  double ms          = {};
+  double allocations = {};
+};
+
+template <typename F>
+static sample_t measure(size_t iterations, F f) {
+  auto allocations_start = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i{}; i < iterations; ++i) {
+    f();
+  }
+  auto finish = std::chrono::steady_clock::now();
+  auto count = static_cast<double>(iterations);
+  return {
+    .ms          = std::chrono::duration<double, std::milli>(finish - start).count() / count,
+    .allocations = static_cast<double>(allocations.load() - allocations_start) / count,
+  };
+}
+
+
+
+struct result_t {
+  std::string workload    = {};
+  std::string stage       = {};
+  std::string unit        = {};
+  size_t      ops         = {};
+  double      ms          = {};
+  double      allocations = {};
+
+  double ns_per_op() const {
+    return ops ? ms * 1e6 / static_cast<double>(ops) : 0;
+  }
+
+  double ops_per_s() const {
+    return ms > 0 ? static_cast<double>(ops) / ms * 1e3 : 0;
+  }
+};
+
+static std::vector<result_t> results;
+
+static void report(const std::string& workload, const std::string& stage, const std::string& unit, size_t ops, sample_t sample) {
+  result_t result = {workload, stage, unit, ops, sample.ms, sample.allocations};
+  std::cout << std::left << std::setw(12) << workload << std::setw(16) << stage << std::right
+    << std::setw(12) << std::fixed << std::setprecision(3) << result.ms << " ms"
+    << std::setw(12) << std::setprecision(1) << result.ns_per_op() << " ns/" << std::left << std::setw(7) << unit << std::right
+    << std::setw(10) << std::setprecision(2) << result.ops_per_s() / 1e6 << " M" << unit << "/s"
+    << std::setw(12) << std::setprecision(0) << result.allocations << " allocs" << std::endl;
+  results.push_back(result);
+}
+
+static void write_json(const std::string& filename) {
+  std::ofstream file(filename);
+  file << "{\n  \"results\": [\n";
+  for (size_t i{}; i < results.size(); ++i) {
+    const auto& result = results[i];
+    file << "    {\"workload\": \"" << result.workload << "\", \"stage\": \"" << result.stage
+      << "\", \"unit\": \"" << result.unit << "\", \"ops\": " << result.ops
+      << ", \"ms\": " << result.ms << ", \"ns_per_op\": " << result.ns_per_op()
+      << ", \"ops_per_s\": " << result.ops_per_s() << ", \"allocations\": " << result.allocations
+      << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  file << "  ]\n}\n";
+}
+
+
+
+struct workload_t {
+  std::string name     = {};
+  std::string code     = {};
+  std::string filename = std::string(AML_SOURCE_DIR) + "/bench.aml";
+};
+
+static void bench_pipeline(const workload_t& workload, size_t iterations) {
+  // each stage is timed on the output of the previous one, stages that rewrite their input get fresh copies
+  token_n::symbols_t symbols;
+  token_n::tokens_t tokens;
+  auto sample_lex = measure(iterations, [&]() {
+    token_n::symbols_t symbols_lex;
+    tokens = token_n::process(workload.code, symbols_lex);
+  });
+  tokens = token_n::process(workload.code, symbols);
+  report(workload.name, "lex", "token", tokens.size(), sample_lex);
+
+  aml::lisp_tree_n::lisp_tree_t tree;
+  auto sample_lisp = measure(iterations, [&]() { tree = aml::lisp_tree_n::process(tokens); });
+  report(workload.name, "lisp_tree", "token", tokens.size(), sample_lisp);
+
+  std::vector<std::unique_ptr<aml::arena_n::arena_t>> arenas;
+  std::vector<stmt_n::stmt_t*> stmts;
+  auto sample_parse = measure(iterations, [&]() {
+    arenas.push_back(std::make_unique<aml::arena_n::arena_t>());
+    stmts.push_back(aml_n::syntax_analyzer_n::process(tree, workload.filename, symbols, *arenas.back()));
+  });
+  report(workload.name, "parse", "token", tokens.size(), sample_parse);
+
+  size_t index = {};
+  auto sample_optimize = measure(iterations, [&]() {
+    aml_n::inliner_n::process(stmts[index], 16, *arenas[index]);
+    aml_n::constant_folder_n::process(stmts[index], *arenas[index]);
+    index++;
+  });
+  auto funcs = static_cast<stmt_n::stmt_program_t*>(stmts.front())->funcs.size();
+  report(workload.name, "optimize", "defn", funcs, sample_optimize);
+
+  code_n::code_ctx_t code_ctx;
+  auto sample_codegen = measure(iterations, [&]() { code_ctx = aml_n::intermediate_code_generator_n::process(stmts.front()); });
+  report(workload.name, "codegen", "byte", code_ctx.code.buffer.size(), sample_codegen);
+
+  std::string image;
+  auto sample_save = measure(iterations, [&]() { image = image_n::save(code_ctx); });
+  report(workload.name, "save", "byte", image.size(), sample_save);
+
+  code_n::program_t program;
+  auto sample_load = measure(iterations, [&]() { image_n::image_t::view(image)->prepare(program); });
+  report(workload.name, "load", "byte", image.size(), sample_load);
+
+  size_t cmds = {};
+  code_n::stack_t stack_count;
+  stack_count.rip = program.rip;
+  while (stack_count.step(program)) cmds++;
+
+  auto sample_execute = measure(iterations, [&]() {
+    code_n::stack_t stack;
+    stack.rip = program.rip;
+    size_t budget = -1;
+    stack.run(program, budget);
+  });
+  report(workload.name, "execute", "cmd", cmds, sample_execute);
+}
+
+
+
+static void bench_dispatch(size_t iterations) {
+  auto image = aml_n::options_t{.input = source_recursion, .filename = std::string(AML_SOURCE_DIR) + "/bench.aml", .cmd = "compile"};
+  if (!aml_n::compile(image))
+    throw std::runtime_error(image.errors);
+  code_n::program_t program;
+  image_n::image_t::view(image.output)->prepare(program);
+
+  size_t cmds = {};
+  int64_t result_step = {};
+  int64_t result_run = {};
+
+  auto sample_step = measure(iterations, [&]() {
+    code_n::stack_t stack;
+    stack.rip = program.rip;
+    for (cmds = 0; stack.step(program); ++cmds) { }
+    result_step = stack.back();
+  });
+
+  auto sample_run = measure(iterations, [&]() {
+    code_n::stack_t stack;
+    stack.rip = program.rip;
+    size_t budget = -1;
+    stack.run(program, budget);
+    result_run = stack.back();
+  });
+
+  if (result_step != result_run)
+    throw std::runtime_error("step and run results differ");
+
+  report("dispatch", "step", "cmd", cmds, sample_step);
+  report("dispatch", "run", "cmd", cmds, sample_run);
+}
+
+
+
+static void bench_env(size_t iterations) {
+  // defn, func + and two calls per defn resolve names
+  const size_t count = 50000;
+  auto code = generate_funcs(count);
+  auto filename = std::string(AML_SOURCE_DIR) + "/bench.aml";
+  token_n::symbols_t symbols;
+  auto tokens = token_n::process(code, symbols);
+  auto tree = aml::lisp_tree_n::process(tokens);
+
+  auto sample = measure(iterations, [&]() {
+    aml::arena_n::arena_t arena;
+    auto options = stmt_n::options_t{.filename = filename, .symbols = &symbols, .arena = &arena};
+    stmt_n::stmt_t::parse(tree, nullptr, {stmt_n::type_t::stmt_program}, options);
+  });
+  report("env", "parse", "lookup", count * 3, sample);
+}
+
+
+
+static void bench_codegen(size_t iterations) {
+  const size_t count = 50000;
+  auto code = generate_funcs(count);
+  auto filename = std::string(AML_SOURCE_DIR) + "/bench.aml";
+  token_n::symbols_t symbols;
+  aml::arena_n::arena_t arena;
+  auto tokens    = aml_n::lexical_analyzer_n::process(code, symbols);
+  auto lisp_tree = aml_n::syntax_lisp_analyzer_n::process(tokens);
+  auto stmt      = aml_n::syntax_analyzer_n::process(lisp_tree, filename, symbols, arena);
+
+  size_t jobs_max = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  for (size_t jobs = 1; jobs <= jobs_max; jobs *= 2) {
+    auto sample = measure(iterations, [&]() { aml_n::intermediate_code_generator_n::process(stmt, jobs); });
+    report("codegen", "jobs " + std::to_string(jobs), "defn", count, sample);
+  }
+}
+
+
+
+static void bench_image(size_t iterations) {
+  aml_n::options_t options = {
+    .input    = generate_funcs(50000),
+    .filename = std::string(AML_SOURCE_DIR) + "/bench.aml",
+    .cmd      = "compile",
+  };
+  if (!aml_n::compile(options))
+    throw std::runtime_error(options.errors);
+
+  auto filename = (std::filesystem::temp_directory_path() / "aml_bench_image.amlb").string();
+  aml::utils_n::str_to_file(options.output, filename);
+
+  auto execute = [&](bool map) {
+    aml_n::options_t options_execute = {.cmd = "execute"};
+    if (map)
+      options_execute.file_input = filename;
+    else
+      options_execute.input = aml::utils_n::str_from_file(filename);
+    if (!aml_n::execute(options_execute))
+      throw std::runtime_error(options_execute.errors);
+  };
+
+  auto sample_read = measure(iterations, [&]() { execute(false); });
+  auto sample_map  = measure(iterations, [&]() { execute(true); });
+  std::filesystem::remove(filename);
+
+  report("image", "read", "byte", options.output.size(), sample_read);
+  report("image", "map", "byte", options.output.size(), sample_map);
+}
+
+
+
+static void bench_encoding(size_t iterations) {
+  auto compile = [](const std::string& code, const std::string& encoding) {
+    aml_n::options_t options = {
+      .input    = code,
+      .filename = std::string(AML_SOURCE_DIR) + "/bench.aml",
+      .cmd      = "compile",
+      .encoding = encoding,
+    };
+    if (!aml_n::compile(options))
+      throw std::runtime_error(options.errors);
+    return options.output;
+  };
+
+  auto source_funcs = generate_funcs(50000);
+  for (std::string encoding : {"packed", "aligned"}) {
+    auto image_fib   = compile(source_recursion, encoding);
+    auto image_funcs = compile(source_funcs, encoding);
+
+    code_n::program_t program;
+    auto sample_prepare = measure(iterations, [&]() {
+      image_n::image_t::view(image_funcs)->prepare(program);
+    });
+    report("encoding", encoding + " load", "byte", image_funcs.size(), sample_prepare);
+
+    image_n::image_t::view(image_fib)->prepare(program);
+    size_t cmds = {};
+    code_n::stack_t stack_count;
+    stack_count.rip = program.rip;
+    while (stack_count.step(program)) cmds++;
+
+    auto sample_run = measure(iterations, [&]() {
+      code_n::stack_t stack;
+      stack.rip = program.rip;
+      size_t budget = -1;
+      stack.run(program, budget);
+    });
+    report("encoding", encoding + " run", "cmd", cmds, sample_run);
+  }
+}
+
+
+
+static void bench_api(size_t iterations) {
+  // a small rule evaluated many times, through the image string and through a compiled program
+  aml_n::options_t options = {
+    .input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (call (func +) (call (func *) (arg 1) (int 3)) (arg 2))
+    )AML",
+    .filename = std::string(AML_SOURCE_DIR) + "/bench.aml",
+    .cmd      = "compile",
+  };
+  auto image = options;
+  if (!aml_n::compile(image))
+    throw std::runtime_error(image.errors);
+  auto program = aml_n::compile_program(options);
+  if (!program)
+    throw std::runtime_error(options.errors);
+
+  auto sample_image = measure(iterations, [&]() {
+    aml_n::options_t options_execute = {.input = image.output, .cmd = "execute"};
+    aml_n::execute(options_execute);
+  });
+
+  code_n::stack_t stack;
+  int64_t sum = {};
+  auto sample_program = measure(iterations, [&]() {
+    int64_t args[] = {sum & 0xFF, 1};
+    sum += aml_n::execute(*program, args, stack).value;
+  });
+
+  report("api", "image", "call", 1, sample_image);
+  report("api", "program", "call", 1, sample_program);
+}
+
+
+
+static void bench_batch(size_t iterations) {
+  // rows of uneven cost: fib of 0 to 10 and 20, the workers steal from the ones with the expensive rows
+  aml_n::options_t options = {
+    .input    = source_recursion.substr(0, source_recursion.rfind("(call")) + "(call (func fib) (arg 1))",
+    .filename = std::string(AML_SOURCE_DIR) + "/bench.aml",
+  };
+  auto program = aml_n::compile_program(options);
+  if (!program)
+    throw std::runtime_error(options.errors);
+
+  std::vector<int64_t> rows(10000);
+  for (size_t i{}; i < rows.size(); ++i)
+    rows[i] = static_cast<int64_t>(i < 100 ? 20 : i % 10);
+  std::vector<aml_n::result_t> results(rows.size());
+
+  size_t jobs_max = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  for (size_t jobs = 1; jobs <= jobs_max; jobs *= 2) {
+    auto sample = measure(iterations, [&]() { aml_n::execute_batch(*program, rows, 1, results, jobs); });
+    report("batch", "jobs " + std::to_string(jobs), "row", rows.size(), sample);
+  }
+}
+
+
+
+static void bench_scheduler(size_t iterations) {
+  // many short tenant scripts time-sliced on one thread
+  aml_n::options_t options = {
+    .input    = source_recursion.substr(0, source_recursion.rfind("(call")) + "(call (func fib) (arg 1))",
+    .filename = std::string(AML_SOURCE_DIR) + "/bench.aml",
+  };
+  auto program = aml_n::compile_program(options);
+  if (!program)
+    throw std::runtime_error(options.errors);
+
+  const size_t count = 10000;
+  aml::scheduler_n::counters_t counters;
+  auto sample = measure(iterations, [&]() {
+    aml::scheduler_n::scheduler_t scheduler({.slice = 200, .stack_capacity = 256});
+    for (size_t i{}; i < count; ++i) {
+      int64_t args[] = {static_cast<int64_t>(i % 12)};
+      scheduler.spawn(program, args);
+    }
+    scheduler.run();
+    counters = scheduler.counters;
+  });
+  report("scheduler", "tasks", "task", count, sample);
+  report("scheduler", "slices", "slice", counters.slices, sample);
+  std::cout << "scheduler   latency mean " << counters.latency_mean_us() << " us, max "
+    << std::chrono::duration<double, std::micro>(counters.latency_max).count() << " us" << std::endl;
+}
+
+
+
+static void bench_memoize(size_t iterations) {
+  // fib of 25 with the results of its calls computed and cached, per execution the cache starts empty
+  for (bool memoize : {false, true}) {
+    aml_n::options_t options = {
+      .input    = source_recursion.substr(0, source_recursion.rfind("(call")) + "(call (func fib) (arg 1))",
+      .filename = std::string(AML_SOURCE_DIR) + "/bench.aml",
+      .memoize  = memoize,
+    };
+    auto program = aml_n::compile_program(options);
+    if (!program)
+      throw std::runtime_error(options.errors);
+
+    code_n::stack_t stack;
+    int64_t args[] = {25};
+    auto sample = measure(iterations, [&]() { aml_n::execute(*program, args, stack); });
+    report("memoize", memoize ? "on" : "off", "run", 1, sample);
+  }
+}
+
+
+
+static void bench_array(size_t iterations) {
+  // the kernels of every isa of the cpu over 64k elements
+  std::vector<int64_t> a(1 << 16);
+  std::vector<int64_t> b(a.size());
+  std::vector<int64_t> c(a.size());
+  for (size_t i{}; i < a.size(); ++i) {
+    a[i] = static_cast<int64_t>(i * 7919 % 10007) - 5000;
+    b[i] = static_cast<int64_t>(i % 13);
+  }
+  for (auto isa : {array_n::isa_t::scalar, array_n::isa_t::sse, array_n::isa_t::avx2}) {
+    if (!array_n::supported(isa))
+      continue;
+    const auto& kernels = array_n::kernels(isa);
+    int64_t sink = {};
+    auto sample_sum  = measure(iterations, [&]() { sink += kernels.sum(a.data(), a.size()); });
+    auto sample_max  = measure(iterations, [&]() { sink += kernels.max(a.data(), a.size()); });
+    auto sample_dot  = measure(iterations, [&]() { sink += kernels.dot(a.data(), b.data(), a.size()); });
+    auto sample_mul  = measure(iterations, [&]() { kernels.mul(c.data(), a.data(), b.data(), a.size()); });
+    auto sample_scan = measure(iterations, [&]() { kernels.prefix_sum(c.data(), c.size()); });
+    auto name = array_n::show(isa);
+    report("array", name + " sum", "elem", a.size(), sample_sum);
+    report("array", name + " max", "elem", a.size(), sample_max);
+    report("array", name + " dot", "elem", a.size(), sample_dot);
+    report("array", name + " mul", "elem", a.size(), sample_mul);
+    report("array", name + " prefix_sum", "elem", a.size(), sample_scan);
+    if (!sink)
+      std::cout << "array       sink " << sink << std::endl;
+  }
+
+  // a sum by a recursion over array_get against a single array_sum, the fill is common to both
+  for (std::string expr : {
+      "(call (func sum) (var a) (int 0) (int 0))",
+      "(call (func array_sum) (var a))"}) {
+    aml_n::options_t options = {
+      .input = R"AML(
+        (#include "aml/standard/standard.aml")
+        (defn fill
+          (if (call (func <) (arg 2) (call (func array_size) (arg 1)))
+            (block
+              (call (func array_set) (arg 1) (arg 2) (arg 2))
+              (call (func fill) (arg 1) (call (func +) (arg 2) (int 1))))
+            (arg 1)))
+        (defn sum
+          (if (call (func <) (arg 2) (call (func array_size) (arg 1)))
+            (call (func sum) (arg 1) (call (func +) (arg 2) (int 1)) (call (func +) (arg 3) (call (func array_get) (arg 1) (arg 2))))
+            (arg 3)))
+        (defn main
+          (block
+            (defvar a (call (func fill) (call (func array) (arg 1)) (int 0)))
+            )AML" + expr + R"AML())
+        (call (func main) (arg 1))
+      )AML",
+      .filename = std::string(AML_SOURCE_DIR) + "/bench.aml",
+    };
+    auto program = aml_n::compile_program(options);
+    if (!program)
+      throw std::runtime_error(options.errors);
+
+    code_n::stack_t stack;
+    int64_t args[] = {10000};
+    auto sample = measure(iterations, [&]() { aml_n::execute(*program, args, stack); });
+    report("array", expr.find("array_sum") != std::string::npos ? "script array_sum" : "script recursion",
+        "run", 1, sample);
+  }
+}
+
+
+
+static void bench_module(size_t iterations) {
+  auto module_cache = std::filesystem::temp_directory_path() / "aml_bench_module_cache";
+  std::filesystem::remove_all(module_cache);
+
+  auto compile = [&](const std::string& cache) {
+    aml_n::options_t options = {
+      .input        = source_recursion,
+      .filename     = std::string(AML_SOURCE_DIR) + "/bench.aml",
+      .cmd          = "compile",
+      .module_cache = cache,
+    };
+    if (!aml_n::compile(options))
+      throw std::runtime_error(options.errors);
+  };
+
+  auto sample_parse = measure(iterations, [&]() { compile({}); });
+  compile(module_cache.string());
+  auto sample_cache = measure(iterations, [&]() { compile(module_cache.string()); });
+  std::filesystem::remove_all(module_cache);
+
+  report("module", "parse", "compile", 1, sample_parse);
+  report("module", "cache", "compile", 1, sample_cache);
+}
+
+
+
+int main(int argc, char* argv[]) {
+  // aml_bench [--json <file>] [--filter <workload>]
+  std::string json;
+  std::string filter;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--json")        json   = argv[i + 1];
+    else if (arg == "--filter") filter = argv[i + 1];
+  }
+  auto enabled = [&](const std::string& name) { return filter.empty() || name == filter; };
+
+  try {
+    auto includes = std::filesystem::temp_directory_path() / "aml_bench_includes";
+    std::vector<workload_t> workloads = {
+      {.name = "fib",      .code = source_recursion},
+      {.name = "fact",     .code = source_factorial},
+      {.name = "chain",    .code = generate_chain(2000, 300)},
+      {.name = "funcs",    .code = generate_funcs(5000)},
+      {.name = "tree",     .code = generate_tree(1 << 18)},
+      {.name = "source",   .code = generate_source(1 << 20)},
+      {.name = "includes", .code = generate_includes(includes, 200, 20), .filename = (includes / "main.aml").string()},
+    };
+
+    for (const auto& workload : workloads) {
+      if (enabled(workload.name))
+        bench_pipeline(workload, 5);
+    }
+    std::filesystem::remove_all(includes);
+
+    if (enabled("dispatch"))  bench_dispatch(10);
+    if (enabled("env"))       bench_env(3);
+    if (enabled("codegen"))   bench_codegen(3);
+    if (enabled("image"))     bench_image(10);
+    if (enabled("encoding"))  bench_encoding(10);
+    if (enabled("module"))    bench_module(1000);
+    if (enabled("api"))       bench_api(100000);
+    if (enabled("batch"))     bench_batch(3);
+    if (enabled("scheduler")) bench_scheduler(3);
+    if (enabled("memoize"))   bench_memoize(10);
+    if (enabled("array"))     bench_array(300);
+
+    if (!json.empty())
+      write_json(json);
+  } catch (const std::exception& ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
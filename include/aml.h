@@ -1,14 +1,20 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
+#include <span>
+#include <thread>
+#include "image.h"
 #include "lisp_tree.h"
+#include "optimizer.h"
+#include "profile.h"
 #include "stmt.h"
 #include "token.h"
 
 namespace aml::aml_n {
 
   namespace lexical_analyzer_n {
-    token_n::tokens_t process(const std::string& code);
+    token_n::tokens_t process(const std::string& code, token_n::symbols_t& symbols);
   }
 
 
@@ -20,7 +26,8 @@ namespace aml::aml_n {
 
 
   namespace syntax_analyzer_n {
-    std::shared_ptr<stmt_n::stmt_t> process(const lisp_tree_n::lisp_tree_t& tree, const std::string& filename);
+    stmt_n::stmt_t* process(const lisp_tree_n::lisp_tree_t& tree, const std::string& filename, token_n::symbols_t& symbols, arena_n::arena_t& arena,
+        const std::string& module_cache = {});
   }
 
 
@@ -30,8 +37,26 @@ namespace aml::aml_n {
 
 
 
+  namespace inliner_n {
+    size_t process(stmt_n::stmt_t* stmt, size_t threshold, arena_n::arena_t& arena);
+  }
+
+
+
+  namespace constant_folder_n {
+    size_t process(stmt_n::stmt_t* stmt, arena_n::arena_t& arena);
+  }
+
+
+
+  namespace purity_analyzer_n {
+    size_t process(stmt_n::stmt_t* stmt, bool memoize);
+  }
+
+
+
   namespace intermediate_code_generator_n {
-    code_n::code_ctx_t process(std::shared_ptr<stmt_n::stmt_t> stmt);
+    code_n::code_ctx_t process(stmt_n::stmt_t* stmt, size_t jobs = 1);
   }
 
 
@@ -47,21 +72,41 @@ namespace aml::aml_n {
 
 
   namespace executor_n {
-    std::string process(const code_n::code_ctx_t& code_ctx);
+    static inline const size_t budget_default = 1000000;
+    static inline const size_t batch_rows     = 1 << 16;   // rows read, executed and written at once by batch
+    static inline const size_t batch_grain    = 64;        // rows taken by a worker at once
+
+    std::string process(const image_n::image_t& image, size_t stack_capacity, size_t heap_capacity,
+        size_t budget = budget_default, profile_n::profile_t* profile = {});
   }
 
 
 
   struct options_t {
-    std::string file_output = {};
-    std::string file_input  = {};
-    std::string input       = {};
-    std::string output      = {};
-    std::string filename    = {};
-    std::string file_log    = {};
-    std::string level       = {};
-    std::string errors      = {};
-    std::string cmd         = {};
+    std::string file_output      = {};
+    std::string file_input       = {};
+    std::string input            = {};
+    std::string output           = {};
+    std::string filename         = {};
+    std::string file_log         = {};
+    std::string level            = {};
+    std::string errors           = {};
+    std::string cmd              = {};
+    std::string module_cache     = {};
+    std::string encoding         = "packed";
+    std::string profile          = {};
+    std::string rows             = {};
+    std::string report           = {};
+    size_t      stack_capacity   = code_n::stack_t::capacity_default;
+    size_t      heap_capacity    = array_n::heap_t::capacity_default;
+    size_t      budget           = executor_n::budget_default;
+    size_t      inline_threshold = 16;
+    size_t      inlined          = {};
+    bool        fold             = true;
+    size_t      folded           = {};
+    bool        memoize          = {};
+    size_t      pure             = {};
+    size_t      jobs             = std::thread::hardware_concurrency();
 
     std::string show();
     void preprocessing();
@@ -70,7 +115,50 @@ namespace aml::aml_n {
 
 
 
+  // a program compiled once and executed many times, read only and shareable between threads
+  struct program_t {
+    code_n::program_t            code   = {};
+    std::vector<code_n::label_t> labels = {};
+  };
+
+  using program_sptr_t = std::shared_ptr<const program_t>;
+
+  enum class status_t {
+    ok,               // completed
+    suspended,        // the fuel ran out, the stack holds the state to resume
+    error,            // stack overflow, invalid stack access or jump
+    invalid_output,   // the stack does not hold exactly one result
+  };
+
+  struct result_t {
+    status_t    status = {};
+    int64_t     value  = {};
+    std::string error  = {};
+    size_t      cmds   = {};   // executed by the call
+
+    explicit operator bool() const { return status == status_t::ok; }
+  };
+
+
+
   bool compile(options_t& options);
   bool execute(options_t& options);
+  bool batch(options_t& options);
   bool run(options_t& options);
+
+  // options.input or options.file_input as code or as a compiled image, nullptr and options.errors on failure
+  program_sptr_t compile_program(options_t& options);
+  program_sptr_t load_program(options_t& options);
+
+  // (arg n) of the top level expression reads args[n - 1], the stack is reset and reused between calls,
+  // at most fuel cmds are executed, a suspended execution continues from its stack with resume
+  result_t execute(const program_t& program, std::span<const int64_t> args, code_n::stack_t& stack,
+      size_t fuel = executor_n::budget_default);
+  result_t execute(const program_t& program, std::span<const int64_t> args);
+  result_t resume(const program_t& program, code_n::stack_t& stack, size_t fuel);
+
+  // rows of arity args each, results[i] of the row i, every worker runs on a stack of its own and steals rows when idle
+  void execute_batch(const program_t& program, std::span<const int64_t> rows, size_t arity, std::span<result_t> results,
+      size_t jobs, size_t stack_capacity = code_n::stack_t::capacity_default,
+      size_t heap_capacity = array_n::heap_t::capacity_default, size_t budget = executor_n::budget_default);
 }
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+#include <memory_resource>
+#include <span>
+#include <vector>
+
+namespace aml::arena_n {
+
+  // bump allocator for objects that live until the end of a compilation, everything is released at once
+  struct arena_t {
+    using dtor_t = void(*)(void*);
+
+    static inline const size_t block_size = 0x10000;
+
+    std::pmr::monotonic_buffer_resource   resource;
+    std::vector<std::pair<void*, dtor_t>> dtors;
+
+    arena_t() : resource(block_size) { }
+    arena_t(const arena_t&) = delete;
+    arena_t& operator=(const arena_t&) = delete;
+
+    ~arena_t() {
+      for (auto it = dtors.rbegin(); it != dtors.rend(); ++it) {
+        it->second(it->first);
+      }
+    }
+
+    template <typename T, typename... args_t>
+    T* make(args_t&&... args) {
+      auto obj = new (resource.allocate(sizeof(T), alignof(T))) T(std::forward<args_t>(args)...);
+      if constexpr (!std::is_trivially_destructible_v<T>)
+        dtors.push_back({obj, [](void* ptr) { static_cast<T*>(ptr)->~T(); }});
+      return obj;
+    }
+
+    template <typename T>
+    std::span<T> array(size_t size) {
+      static_assert(std::is_trivially_destructible_v<T>);
+      auto ptr = static_cast<T*>(resource.allocate(sizeof(T) * std::max(size, size_t{1}), alignof(T)));
+      std::uninitialized_value_construct_n(ptr, size);
+      return {ptr, size};
+    }
+
+    template <typename T>
+    std::span<T> array(std::span<const T> values) {
+      auto span = array<T>(values.size());
+      std::copy(values.begin(), values.end(), span.begin());
+      return span;
+    }
+  };
+}
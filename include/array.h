@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+namespace aml::array_n {
+  namespace utils_n = aml::utils_n;
+
+
+
+  // syscalls of the int64 arrays, an array is referred to by its handle on the stack
+  enum class syscall_t : int64_t {
+    make       = 400,   // (size) -> handle of zeros
+    get        = 401,   // (handle index) -> value
+    set        = 402,   // (handle index value) -> value
+    size       = 403,   // (handle) -> size
+    sum        = 410,   // (handle) -> sum
+    min        = 411,   // (handle) -> min, 0 if empty
+    max        = 412,   // (handle) -> max, 0 if empty
+    dot        = 413,   // (handle handle) -> dot product
+    add        = 414,   // (handle handle) -> handle of the elementwise sums
+    mul        = 415,   // (handle handle) -> handle of the elementwise products
+    prefix_sum = 416,   // (handle) -> handle, in place
+    sort       = 417,   // (handle) -> handle, in place, ascending
+  };
+
+  static inline const int64_t syscall_first = static_cast<int64_t>(syscall_t::make);
+  static inline const int64_t syscall_last  = static_cast<int64_t>(syscall_t::sort);
+  static inline const size_t  args_max      = 3;
+
+
+
+  // bulk operations over int64, sums and products wrap around like op_add and op_mul of the vm, dst may alias the sources
+  struct kernels_t {
+    int64_t (*sum)(const int64_t* a, size_t n);
+    int64_t (*min)(const int64_t* a, size_t n);
+    int64_t (*max)(const int64_t* a, size_t n);
+    int64_t (*dot)(const int64_t* a, const int64_t* b, size_t n);
+    void    (*add)(int64_t* dst, const int64_t* a, const int64_t* b, size_t n);
+    void    (*mul)(int64_t* dst, const int64_t* a, const int64_t* b, size_t n);
+    void    (*prefix_sum)(int64_t* a, size_t n);
+    void    (*sort)(int64_t* a, size_t n);
+  };
+
+  enum class isa_t {
+    scalar,
+    sse,    // sse4.2, 2 lanes
+    avx2,   // 4 lanes
+  };
+
+  std::string show(isa_t isa);
+  bool supported(isa_t isa);
+  // the widest isa of the cpu, detected once at startup
+  isa_t isa_best();
+  const kernels_t& kernels(isa_t isa = isa_best());
+
+
+
+  // arrays of an execution, freed all at once when the stack is reset for the next one,
+  // their storage is kept and reused
+  struct heap_t {
+    static inline const size_t capacity_default = 1 << 22;   // int64 elements in all arrays
+    static inline const size_t elements_per_cmd = 8;         // fuel of a bulk syscall, sort is charged n log n
+
+    std::vector<std::vector<int64_t>> arrays   = {};
+    size_t                            count    = {};
+    size_t                            used     = {};
+    size_t                            capacity = capacity_default;
+    size_t                            debt     = {};   // cmds of bulk syscalls not yet taken from the fuel
+    const kernels_t*                  kernels  = &array_n::kernels();
+
+    int64_t make(int64_t size);
+    std::span<int64_t> at(int64_t handle);
+    // -1 for an unknown syscall or a wrong number of args, throws on invalid handles and indices
+    int64_t syscall(int64_t op, std::span<const int64_t> args);
+
+    // a bulk syscall runs to its end, its cost is taken from the fuel after it and from the next runs while in debt,
+    // a run overshoots its fuel by a single syscall over at most capacity elements
+    void pay(size_t& fuel) {
+      auto paid = std::min(fuel, debt);
+      fuel -= paid;
+      debt -= paid;
+    }
+
+    void clear() {
+      count = {};
+      used  = {};
+      debt  = {};
+    }
+  };
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "utils.h"
+
+namespace aml::batch_n {
+  namespace utils_n = aml::utils_n;
+
+
+
+  // a range of rows owned by a worker, taken from the front by the owner and split from the back by thieves
+  struct queue_t {
+    std::mutex mutex = {};
+    size_t     begin = {};
+    size_t     end   = {};
+
+    bool take(size_t grain, size_t& first, size_t& last);
+    bool steal(queue_t& victim);
+  };
+
+  using task_t = std::function<void(size_t worker, size_t begin, size_t end)>;
+
+  // runs task over [0, count) in chunks of grain rows on jobs workers, the calling thread is worker 0,
+  // a worker out of rows steals half of the largest range left, rounded up
+  void process(size_t count, size_t jobs, size_t grain, const task_t& task);
+}
@@ -1,10 +1,21 @@
 #pragma once
 
-#include <deque>
+#include <memory>
+#include <span>
 #include <string>
 #include <vector>
 
+#include "array.h"
+#include "utils.h"
+
+namespace aml::profile_n {
+  struct profile_t;
+}
+
 namespace aml::code_n {
+  namespace utils_n = aml::utils_n;
+
+
 
   enum class cmd_id_t : uint8_t {
     arg,
@@ -17,8 +28,25 @@ namespace aml::code_n {
     ret,
     syscall,
     var,
+    extended = 0x0F,
+    add,
+    sub,
+    mul,
+    div,
+    eq,
+    lt,
+    land,
+    lor,
+    lnot,
+    tail_call,
+    memo,
+    memo_ret,
   };
 
+  static inline const size_t cmd_id_count = static_cast<size_t>(cmd_id_t::memo_ret) + 1;
+
+  std::string show(cmd_id_t id);
+
 
 
   struct cmd_t {
@@ -30,7 +58,8 @@ namespace aml::code_n {
       } bits;
       uint8_t cmd;
     };
-    int64_t val;
+    cmd_id_t id;
+    int64_t  val;
 
     cmd_t() = default;
     cmd_t(cmd_id_t cmd_id, int64_t value = {});
@@ -42,20 +71,58 @@ namespace aml::code_n {
 
 
 
+  // native cmds lowered from the arithmetic, comparison and logical syscalls
+  struct native_t {
+    int64_t  syscall;
+    size_t   arity;
+    cmd_id_t id;
+  };
+
+  static inline const std::vector<native_t> natives = {
+    {100, 1, cmd_id_t::lnot},
+    {200, 2, cmd_id_t::add},
+    {201, 2, cmd_id_t::sub},
+    {202, 2, cmd_id_t::mul},
+    {203, 2, cmd_id_t::div},
+    {204, 2, cmd_id_t::eq},
+    {205, 2, cmd_id_t::lt},
+    {206, 2, cmd_id_t::land},
+    {207, 2, cmd_id_t::lor},
+  };
+
+  // returns its argument and suspends run, a scheduler gives the time slice left to other programs
+  static inline const int64_t syscall_yield = 300;
+
+  const native_t* find_native(int64_t syscall, size_t arity);
+
+  // evaluates a native cmd as the vm does, the operands are in the order of the call args
+  int64_t eval_native(cmd_id_t id, int64_t a, int64_t b = {});
+
+
+
   int64_t zigzag_encode(int64_t value);
   int64_t zigzag_decode(int64_t value);
   uint8_t zigzag_size(int64_t value);
 
+  // reads past the end give zeros, the caller checks pos against the size
+  cmd_t read_cmd(std::span<const uint8_t> buffer, size_t& pos);
+
 
 
   struct code_t {
+    // jumps with a forward target are written with a fixed width operand and patched later
+    static inline const size_t fixup_size = 4;
+
     std::vector<uint8_t> buffer;
 
     void write(const void* data, size_t size, size_t pos = std::string::npos);
     void write_u8(uint8_t data);
     void write_i64(int64_t data, size_t pos = std::string::npos);
-    void write_int(int64_t data, size_t size);
+    void write_int(int64_t data, size_t size, size_t pos = std::string::npos);
     void write_cmd(cmd_t cmd);
+    size_t write_fixup(cmd_id_t cmd_id);
+    void patch(size_t fixup);
+    void resolve(size_t fixup, int64_t value);
 
     void read(void* data, size_t size, size_t& pos) const;
     uint8_t read_u8(size_t& pos) const;
@@ -68,10 +135,28 @@ namespace aml::code_n {
 
 
 
+  // function addresses are pushed as fixups and resolved when the functions are laid out
+  struct reloc_t {
+    size_t        fixup  = {};
+    const size_t* offset = {};
+  };
+
+  // defn names by their offsets, saved as the symbols section of the image
+  struct label_t {
+    size_t      offset = {};
+    std::string name   = {};
+  };
+
   struct code_ctx_t {
-    code_t  code;
-    size_t  rip = {};
-    size_t  rsp = {};
+    code_t               code;
+    size_t               rip    = {};
+    size_t               rsp    = {};
+    size_t               jobs   = 1;
+    std::vector<reloc_t> relocs = {};
+    std::vector<label_t> labels = {};
+
+    void append(const code_ctx_t& other);
+    void link();
 
     std::string save() const;
     void load(const std::string&);
@@ -79,18 +164,132 @@ namespace aml::code_n {
 
 
 
+  enum class encoding_t : uint32_t {
+    packed,    // header byte and a zigzag operand of 0-8 bytes, see cmd_t::encode
+    aligned,   // a 32-bit word per cmd: id:8 wide:1 val:23, wide operands index the pool
+  };
+
+  static inline const uint32_t aligned_wide      = 1 << 8;
+  static inline const int      aligned_val_shift = 9;
+  static inline const int64_t  aligned_val_max   = (1 << 22) - 1;
+  static inline const int64_t  aligned_val_min   = -(1 << 22);
+
+  // the linked code of code_ctx_t in the aligned encoding, offsets are cmd indices
+  struct aligned_code_t {
+    std::vector<uint32_t> words  = {};
+    std::vector<int64_t>  pool   = {};
+    size_t                rip    = {};
+    std::vector<label_t>  labels = {};
+  };
+
+  aligned_code_t align(const code_ctx_t& code_ctx);
+
+
+
+  struct program_t {
+    static inline const size_t npos = -1;
+
+    std::vector<cmd_t>  cmds;
+    std::vector<size_t> index;
+    size_t              rip = {};
+
+    void prepare(const code_ctx_t& code_ctx);
+    void prepare(std::span<const uint8_t> code, size_t entry);
+    void prepare_aligned(std::span<const uint8_t> words, std::span<const uint8_t> pool, size_t entry);
+    void resolve(const std::vector<size_t>& ends, size_t entry);
+    size_t target(int64_t offset) const;
+    std::string show() const;
+  };
+
+
+
+  // call frame header between the arguments and the locals: <count> <rbp> <rip>
+  const static inline size_t frame_size = 3;
+
+  // results of pure defns by their args, memo <operand> at the entry looks a call up and returns on a hit,
+  // memo_ret <operand> stores the result, the operand is id << arity_bits | arity,
+  // a direct mapped table: a colliding result replaces the older one
+  struct memo_t {
+    static inline const size_t  capacity_default = 4096;
+    static inline const size_t  args_max         = 4;
+    static inline const int64_t arity_bits       = 3;
+
+    struct entry_t {
+      size_t  generation     = {};
+      int64_t func           = {};
+      size_t  count          = {};
+      int64_t args[args_max] = {};
+      int64_t value          = {};
+    };
+
+    std::vector<entry_t> entries    = {};
+    size_t               capacity   = capacity_default;
+    size_t               generation = 1;
+    size_t               hits       = {};
+    size_t               misses     = {};
+    bool                 hit        = {};
+
+    // the entries of a previous execution are left in place and ignored
+    void clear() {
+      generation++;
+    }
+  };
+
+
+
+  struct stack_overflow_t : utils_n::fatal_error_t {
+    stack_overflow_t(size_t capacity);
+  };
+
   struct stack_t {
-    std::deque<int64_t> buffer;
-    int64_t rbp = {};
+    static inline const size_t capacity_default = 0x10000;
+
+    std::unique_ptr<int64_t[]> buffer;
+    size_t  capacity = {};
+    size_t  top = {};
+    size_t  rbp = {};
     size_t  rip = {};
-    size_t  limit = 0xFFFF;
-
-    bool step(const code_t& code);
-    size_t size() const;
-    int64_t& get(size_t pos);
-    int64_t& back();
-    void push_back(int64_t value);
-    void pop_back();
+    bool    yield = {};
+    memo_t  memo;
+    array_n::heap_t heap;
+
+    stack_t(size_t capacity = capacity_default, size_t heap_capacity = array_n::heap_t::capacity_default);
+
+    bool step(const program_t& program);
+    // budget is left with the cmds not executed, bulk array syscalls are charged by their elements,
+    // false if it ran out or the program yielded
+    bool run(const program_t& program, size_t& budget);
+    bool run(const program_t& program, size_t& budget, profile_n::profile_t& profile);
     std::string show() const;
+
+    size_t size() const {
+      return top;
+    }
+
+    int64_t& get(size_t pos) {
+      if (pos >= top)
+        throw utils_n::fatal_error_t("stack_t: invalid access " + std::to_string(pos));
+      return buffer[pos];
+    }
+
+    int64_t& back() {
+      return get(top - 1);
+    }
+
+    void push_back(int64_t value) {
+      if (top == capacity)
+        throw stack_overflow_t(capacity);
+      buffer[top++] = value;
+    }
+
+    void pop_back() {
+      resize(top - 1);
+    }
+
+    void resize(size_t size) {
+      if (size > top)
+        throw utils_n::fatal_error_t("stack_t: stack underflow");
+      top = size;
+    }
   };
 }
@@ -1,20 +1,27 @@
 #pragma once
 
-#include <deque>
+#include <atomic>
 #include <memory>
-#include <algorithm>
+#include <vector>
 
+#include "code_segment.h"
+#include "token.h"
 #include "utils.h"
 
 namespace aml::env_n {
   namespace utils_n = aml::utils_n;
+  namespace code_n = aml::code_n;
+  namespace token_n = aml::token_n;
 
 
 
   struct var_info_t {
-    size_t      id = {};
-    std::string name;
-    size_t      offset = {};
+    size_t            id = {};
+    token_n::symbol_t symbol;
+    std::string       name;
+    size_t            offset = {};
+
+    const code_n::native_t* native = nullptr;
 
     std::string show() const;
   };
@@ -23,72 +30,87 @@ namespace aml::env_n {
 
 
 
-  struct env_t : std::enable_shared_from_this<env_t> {
-    using key_t = std::string;
-    using val_t = var_info_sptr_t;
-    using vars_t = std::deque<val_t>;
-
-    std::shared_ptr<env_t> parent;
-    static inline size_t   id = {};
-    vars_t                 funcs;
-    vars_t                 vars;
+  // bindings of one namespace in definition order, heads maps an interned symbol id to its
+  // innermost binding, a binding keeps the one it shadows to restore it when its scope is popped
+  struct table_t {
+    static inline const size_t npos = -1;
 
-    env_t(std::shared_ptr<env_t> parent = nullptr) : parent(parent) { }
+    struct binding_t {
+      var_info_sptr_t var    = {};
+      size_t          shadow = npos;
+      size_t          scope  = {};
+    };
 
-    val_t def(const auto& key, auto pvars) {
-      auto it = std::find_if((this->*pvars).begin(), (this->*pvars).end(),
-          [&key](auto var) { return key == var->name; });
-      if (it != (this->*pvars).end())
-        throw utils_n::fatal_error_t("env_t: '" + key + "' is exists");
+    std::vector<binding_t> bindings;
+    std::vector<size_t>    heads;
 
-      (this->*pvars).push_back(std::make_shared<var_info_t>());
-      (this->*pvars).back()->id = id++;
-      (this->*pvars).back()->name = key;
-      return (this->*pvars).back();
+    size_t head(const token_n::symbol_t& key) const {
+      return key.id < heads.size() ? heads[key.id] : npos;
     }
 
-    val_t get(const auto& key, auto pvar, auto pvars) const {
-      auto env = this->shared_from_this();
-      while (env) {
-        auto it = std::find_if((*env.*pvars).begin(), (*env.*pvars).end(),
-            [&key, pvar](auto var) { return key == (*var).*pvar; });
-        if (it != (*env.*pvars).end()) {
-          return *it;
-        }
-        env = env->parent;
-      }
-
-      std::string key_str;
-      if constexpr (std::is_same<decltype(key), const size_t&>::value) {
-        key_str = std::to_string(key);
-      } else {
-        key_str = key;
-      }
-      throw utils_n::fatal_error_t("env_t: '" + key_str + "' is not exists");
-    }
+    var_info_sptr_t def(const token_n::symbol_t& key, size_t scope);
+    var_info_sptr_t get(const token_n::symbol_t& key) const;
+    void unwind(size_t size);
+  };
+
+
+
+  // one scoped symbol table per compilation, block and defn push a scope and pop it when parsed
+  struct env_t {
+    using key_t = token_n::symbol_t;
+    using val_t = var_info_sptr_t;
+
+    struct mark_t {
+      size_t funcs = {};
+      size_t vars  = {};
+    };
+
+    // ids are unique across the compilations running in parallel
+    static inline std::atomic<size_t> id = {};
+    table_t                           funcs;
+    table_t                           vars;
+    std::vector<mark_t>               scopes;
 
     val_t def_func(const key_t& key) {
-      return def(key, &env_t::funcs);
+      return funcs.def(key, scopes.size());
     }
 
     val_t get_func(const key_t& key) const {
-      return get(key, &var_info_t::name, &env_t::funcs);
-    }
-
-    val_t get_func(size_t key) const {
-      return get(key, &var_info_t::id, &env_t::funcs);
+      return funcs.get(key);
     }
 
     val_t def_var(const key_t& key) {
-      return def(key, &env_t::vars);
+      return vars.def(key, scopes.size());
     }
 
     val_t get_var(const key_t& key) const {
-      return get(key, &var_info_t::name, &env_t::vars);
+      return vars.get(key);
+    }
+
+    void push_scope() {
+      scopes.push_back({funcs.bindings.size(), vars.bindings.size()});
+    }
+
+    void pop_scope() {
+      funcs.unwind(scopes.back().funcs);
+      vars.unwind(scopes.back().vars);
+      scopes.pop_back();
     }
 
     std::string show() const;
   };
 
   using env_sptr_t = std::shared_ptr<env_t>;
+
+
+
+  struct scope_t {
+    env_t& env;
+
+    scope_t(env_t& env) : env(env) { env.push_scope(); }
+    ~scope_t() { env.pop_scope(); }
+
+    scope_t(const scope_t&) = delete;
+    scope_t& operator=(const scope_t&) = delete;
+  };
 }
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "code_segment.h"
+#include "utils.h"
+
+namespace aml::image_n {
+  namespace utils_n = aml::utils_n;
+  namespace code_n = aml::code_n;
+
+
+
+  // bytecode image: header, section table, sections, all integers are little endian
+  // header:  magic:4 version:u32 count:u32 encoding:u32
+  // section: id:u32 reserved:u32 offset:u64 size:u64
+  static inline const std::string magic   = "AMLB";
+  static inline const uint32_t    version = 1;
+
+  enum class section_id_t : uint32_t {
+    code    = 1,   // encoded cmds
+    entry   = 2,   // rip:u64 rsp:u64
+    symbols = 3,   // count:u64 (offset:u64 size:u64 name)*, optional
+    pool    = 4,   // i64 operands of the aligned encoding
+  };
+
+  static inline const size_t header_size  = 16;
+  static inline const size_t section_size = 24;
+
+  std::string save(const code_n::code_ctx_t& code_ctx, code_n::encoding_t encoding = code_n::encoding_t::packed);
+
+
+
+  // read only bytes of an image, either mapped from a file or viewed in a string,
+  // images without the magic are read as the legacy layout: rip:i64 rsp:i64 code
+  struct image_t {
+    std::span<const uint8_t> data    = {};
+    void*                    mapping = {};
+
+    image_t() = default;
+    image_t(const image_t&) = delete;
+    image_t& operator=(const image_t&) = delete;
+    ~image_t();
+
+    static std::unique_ptr<image_t> map(const std::string& filename);
+    static std::unique_ptr<image_t> view(std::string_view str);
+
+    bool legacy() const;
+    code_n::encoding_t encoding() const;
+    void prepare(code_n::program_t& program) const;
+    std::span<const uint8_t> section(section_id_t id) const;
+    std::span<const uint8_t> code() const;
+    size_t entry() const;
+    std::vector<code_n::label_t> labels() const;
+  };
+}
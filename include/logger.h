@@ -16,7 +16,7 @@ namespace aml::logger_n {
     const char* file;
     int line;
     const char* function;
-    static inline size_t indent = 0;
+    static inline thread_local size_t indent = 0;
     static inline spdlog::level::level_enum level = spdlog::level::off;
 
     static inline const std::string name = "core";
@@ -40,7 +40,11 @@ namespace aml::logger_n {
 
 #define AML_TRACER aml::logger_n::logger_t logger{__FILE__, __LINE__, __PRETTY_FUNCTION__}
 
+// arguments are evaluated only if the level is enabled, they may be expensive to show
 #define AML_LOGGER(lvl, format, ...) \
+  do { \
+    if (aml::logger_n::logger_t::logger->should_log(spdlog::level::lvl)) \
       aml::logger_n::logger_t::logger->log(spdlog::source_loc{__FILE__, __LINE__, __FUNCTION__}, spdlog::level::lvl, \
-          "{}{}: " format, aml::utils_n::indent(aml::logger_n::logger_t::indent), __FUNCTION__, __VA_ARGS__);
+          "{}{}: " format, aml::utils_n::indent(aml::logger_n::logger_t::indent), __FUNCTION__, __VA_ARGS__); \
+  } while (false);
 }
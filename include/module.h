@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "stmt.h"
+
+namespace aml::module_n {
+  namespace utils_n = aml::utils_n;
+  namespace env_n = aml::env_n;
+  namespace stmt_n = aml::stmt_n;
+
+
+
+  // an included file is cached by the hash of its content as its includes and defns in
+  // source order, loading replays them through the env and resolves the includes again,
+  // so every nested file is checked against its own entry and the dedup set of options_t
+  static inline const std::string magic   = "AMLM";
+  static inline const uint8_t     version = 1;
+
+  uint64_t hash(std::string_view data);
+  std::string path(const std::string& dir, std::string_view code);
+
+
+
+  struct writer_t {
+    std::string buffer;
+
+    void write_u8(uint8_t data);
+    void write_u64(uint64_t data);
+    void write_str(std::string_view data);
+    void write_stmt(const stmt_n::stmt_t* stmt);
+  };
+
+
+
+  struct reader_t {
+    std::string_view    buffer;
+    size_t              pos = {};
+    env_n::env_sptr_t   env;
+    stmt_n::options_t&  options;
+
+    uint8_t          read_u8();
+    uint64_t         read_u64();
+    std::string_view read_str();
+    stmt_n::stmt_t*  read_stmt();
+    stmt_n::stmts_t  read_stmts();
+    token_n::symbol_t read_symbol();
+  };
+
+
+
+  // returns nullptr if there is no valid entry for the code
+  stmt_n::stmt_t* load(env_n::env_sptr_t env, stmt_n::options_t& options, std::string_view code);
+  void save(const stmt_n::stmt_program_t* program, const stmt_n::options_t& options, std::string_view code);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <map>
+
+#include "stmt.h"
+
+namespace aml::optimizer_n {
+  namespace utils_n = aml::utils_n;
+  namespace arena_n = aml::arena_n;
+  namespace env_n = aml::env_n;
+  namespace stmt_n = aml::stmt_n;
+
+  using stmt_ptr_t = stmt_n::stmt_t*;
+  using slots_t    = std::vector<stmt_ptr_t*>;
+
+
+
+  struct clone_ctx_t {
+    arena_n::arena_t*                                          arena = nullptr;
+    const std::vector<stmt_ptr_t>*                             args  = nullptr;
+    std::map<const env_n::var_info_t*, env_n::var_info_sptr_t> vars  = {};
+  };
+
+  slots_t children(stmt_ptr_t stmt);
+  stmt_ptr_t copy(stmt_ptr_t stmt, arena_n::arena_t& arena);
+  stmt_ptr_t clone(stmt_ptr_t stmt, clone_ctx_t& ctx);
+  bool trivial(stmt_ptr_t stmt);
+  size_t cost(stmt_ptr_t stmt);
+  int64_t arity(stmt_ptr_t stmt);
+
+
+
+  // replaces calls of small non-recursive defns with their bodies, returns the number of inlined calls
+  size_t inline_calls(stmt_ptr_t stmt, size_t threshold, arena_n::arena_t& arena);
+
+  // evaluates native operators over int operands, drops if branches with a constant condition
+  // and values in blocks that are never read, returns the number of replaced stmts
+  size_t fold_constants(stmt_ptr_t stmt, arena_n::arena_t& arena);
+
+  // marks defns that only read their args, make native syscalls and call pure defns by name,
+  // with memoize the pure defns calling other defns are cached by the vm, returns the number of pure defns
+  size_t mark_pure(stmt_ptr_t stmt, bool memoize);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "code_segment.h"
+#include "utils.h"
+
+namespace aml::profile_n {
+  namespace utils_n = aml::utils_n;
+  namespace code_n = aml::code_n;
+
+
+
+  struct func_t {
+    std::string name      = {};
+    size_t      calls     = {};
+    size_t      inclusive = {};
+    size_t      exclusive = {};
+    size_t      active    = {};   // frames on the call stack, a recursive function is counted inclusive once
+  };
+
+  // a node per distinct call path, the source of the collapsed stacks
+  struct node_t {
+    size_t                   parent   = {};
+    size_t                   func     = {};
+    size_t                   self     = {};
+    std::map<size_t, size_t> children = {};
+  };
+
+  struct frame_t {
+    size_t node  = {};
+    size_t start = {};
+  };
+
+
+
+  // instruction counts of a run, filled by stack_t::run with a profile, the run without one is not instrumented
+  struct profile_t {
+    static inline const std::string root = "main";
+
+    std::array<size_t, code_n::cmd_id_count> cmds      = {};
+    std::vector<func_t>                       funcs     = {};
+    std::map<size_t, size_t>                  entries   = {};   // funcs by the cmd index of their entry
+    std::vector<node_t>                       nodes     = {};
+    std::vector<frame_t>                      frames    = {};
+    size_t                                    total     = {};
+    size_t                                    max_stack = {};
+    size_t                                    max_depth = {};
+
+    void prepare(const code_n::program_t& program, const std::vector<code_n::label_t>& labels);
+    void enter(size_t rip);
+    void leave();
+    void finish();
+
+    std::string report() const;
+    std::string collapsed() const;
+
+    void count(code_n::cmd_id_t id) {
+      cmds[static_cast<size_t>(id)]++;
+      nodes[frames.back().node].self++;
+      total++;
+    }
+
+    void after(code_n::cmd_id_t id, const code_n::stack_t& stack) {
+      max_stack = std::max(max_stack, stack.size());
+      switch (id) {
+        case code_n::cmd_id_t::call:      enter(stack.rip);          break;
+        case code_n::cmd_id_t::tail_call: leave(); enter(stack.rip); break;
+        case code_n::cmd_id_t::ret:       leave();                   break;
+        case code_n::cmd_id_t::memo_ret:  leave();                   break;
+        case code_n::cmd_id_t::memo:      if (stack.memo.hit) leave(); break;
+        default:                                                     break;
+      }
+    }
+  };
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <queue>
+
+#include "aml.h"
+
+namespace aml::scheduler_n {
+  namespace utils_n = aml::utils_n;
+  namespace code_n = aml::code_n;
+  namespace aml_n = aml::aml_n;
+
+
+
+  using time_point_t = std::chrono::steady_clock::time_point;
+  using duration_t   = std::chrono::steady_clock::duration;
+
+  enum class policy_t {
+    round_robin,   // every task gets a slice in turn
+    priority,      // the tasks of the highest priority, in turn among themselves
+  };
+
+  struct options_t {
+    policy_t policy         = policy_t::round_robin;
+    size_t   slice          = 1000;      // fuel of a time slice in cmds
+    size_t   stack_capacity = 1024;      // memory cap of a task in int64 slots
+    size_t   heap_capacity  = 1 << 16;   // int64 elements in the arrays of a task
+    size_t   budget         = aml_n::executor_n::budget_default;   // cmds of a task in all its slices
+  };
+
+  // a green thread: a program suspended between time slices on a stack of its own
+  struct task_t {
+    size_t                id       = {};
+    aml_n::program_sptr_t program  = {};
+    code_n::stack_t       stack;
+    size_t                priority = {};
+    size_t                cmds     = {};
+    time_point_t          ready    = {};
+
+    task_t(size_t capacity, size_t heap_capacity) : stack(capacity, heap_capacity) { }
+  };
+
+  struct counters_t {
+    size_t     spawned     = {};
+    size_t     completed   = {};
+    size_t     failed      = {};
+    size_t     slices      = {};
+    size_t     yields      = {};
+    size_t     cmds        = {};
+    duration_t latency     = {};   // sum of the waits of the slices, from ready to running
+    duration_t latency_max = {};
+    duration_t running     = {};   // time spent in the vm
+
+    double latency_mean_us() const;
+    double cmds_per_s() const;
+    double tasks_per_s() const;
+    std::string show() const;
+  };
+
+
+
+  // multiplexes many programs on the calling thread, a task runs until its slice ends, it yields or completes,
+  // stacks of finished tasks are reused by the next ones
+  struct scheduler_t {
+    using done_t = std::function<void(size_t id, const aml_n::result_t& result)>;
+
+    struct entry_t {
+      size_t  priority = {};
+      size_t  sequence = {};
+      task_t* task     = {};
+
+      bool operator<(const entry_t& other) const {
+        return priority != other.priority ? priority < other.priority : sequence > other.sequence;
+      }
+    };
+
+    options_t                            options  = {};
+    done_t                               done     = {};
+    counters_t                           counters = {};
+    std::priority_queue<entry_t>         queue    = {};
+    std::vector<std::unique_ptr<task_t>> tasks    = {};
+    std::vector<task_t*>                 free     = {};
+    size_t                               sequence = {};
+
+    scheduler_t(options_t options = {}, done_t done = {});
+
+    size_t spawn(aml_n::program_sptr_t program, std::span<const int64_t> args, size_t priority = {});
+    bool step();
+    void run();
+    void push(task_t* task);
+    void finish(task_t* task, const aml_n::result_t& result);
+
+    size_t size() const {
+      return queue.size();
+    }
+  };
+}
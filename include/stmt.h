@@ -1,9 +1,10 @@
 #pragma once
 
-#include <deque>
 #include <memory>
 #include <set>
+#include <span>
 
+#include "arena.h"
 #include "code_segment.h"
 #include "env.h"
 #include "lisp_tree.h"
@@ -11,6 +12,7 @@
 
 namespace aml::stmt_n {
   namespace utils_n = aml::utils_n;
+  namespace arena_n = aml::arena_n;
   namespace code_n = aml::code_n;
   namespace env_n = aml::env_n;
   namespace lisp_tree_n = aml::lisp_tree_n;
@@ -100,9 +102,17 @@ namespace aml::stmt_n {
 
 
 
+  struct stmt_t;
+
+  // nodes and their child spans are owned by the arena of the compilation
+  using stmts_t = std::span<stmt_t*>;
+
   struct options_t {
-    std::string           filename = {};
-    std::set<std::string> files    = {};
+    std::string           filename     = {};
+    std::set<std::string> files        = {};
+    token_n::symbols_t*   symbols      = {};
+    arena_n::arena_t*     arena        = {};
+    std::string           module_cache = {};
   };
 
 
@@ -114,8 +124,10 @@ namespace aml::stmt_n {
     virtual void intermediate_code(code_n::code_ctx_t& code_ctx) const = 0;
     virtual type_t type() const = 0;
 
-    static std::shared_ptr<stmt_t> factory(type_t type);
-    static std::shared_ptr<stmt_t> parse(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, const types_t& types, options_t& options);
+    static stmt_t* factory(type_t type, arena_n::arena_t& arena);
+    static stmt_t* parse(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, const types_t& types, options_t& options);
+    static const code_n::native_t* native(const stmt_t* body);
+    static void mark_tail(stmt_t* body, bool tail = true);
   };
 
 
@@ -130,11 +142,14 @@ namespace aml::stmt_n {
 
 
   struct stmt_program_t : stmt_t {
-    using funcs_t = std::deque<std::shared_ptr<stmt_t>>;
-    using body_t  = std::shared_ptr<stmt_t>;
+    static inline const size_t funcs_per_job = 64;
+
+    using funcs_t = stmts_t;
+    using body_t  = stmt_t*;
 
-    funcs_t funcs;
-    body_t  body;
+    funcs_t funcs = {};
+    body_t  body  = {};
+    stmts_t items = {};   // includes, defns and call in source order
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -156,7 +171,7 @@ namespace aml::stmt_n {
 
 
   struct stmt_block_t : stmt_t {
-    std::deque<std::shared_ptr<stmt_t>> args;
+    stmts_t args = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -167,8 +182,9 @@ namespace aml::stmt_n {
 
 
   struct stmt_call_t : stmt_t {
-    std::shared_ptr<stmt_t>             name;
-    std::deque<std::shared_ptr<stmt_t>> args;
+    stmt_t* name = {};
+    stmts_t args = {};
+    bool    tail = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -179,8 +195,10 @@ namespace aml::stmt_n {
 
 
   struct stmt_defn_t : stmt_t {
-    env_n::var_info_sptr_t  var;
-    std::shared_ptr<stmt_t> body;
+    env_n::var_info_sptr_t var  = {};
+    stmt_t*                body = {};
+    bool                   pure = {};
+    int64_t                memo = -1;   // operand of the memo cmds, -1 if calls are not cached
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -191,8 +209,8 @@ namespace aml::stmt_n {
 
 
   struct stmt_defvar_t : stmt_t {
-    env_n::var_info_sptr_t  var;
-    std::shared_ptr<stmt_t> body;
+    env_n::var_info_sptr_t var  = {};
+    stmt_t*                body = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -203,7 +221,7 @@ namespace aml::stmt_n {
 
 
   struct stmt_func_t : stmt_t {
-    env_n::var_info_sptr_t var;
+    env_n::var_info_sptr_t var = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -214,9 +232,9 @@ namespace aml::stmt_n {
 
 
   struct stmt_if_t : stmt_t {
-    std::shared_ptr<stmt_t> expr_if;
-    std::shared_ptr<stmt_t> expr_then;
-    std::shared_ptr<stmt_t> expr_else;
+    stmt_t* expr_if   = {};
+    stmt_t* expr_then = {};
+    stmt_t* expr_else = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -227,14 +245,15 @@ namespace aml::stmt_n {
 
 
   struct stmt_include_t : stmt_t {
-    std::string             filename;
-    std::shared_ptr<stmt_t> body;
+    std::string filename = {};
+    stmt_t*     body     = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
     void intermediate_code(code_n::code_ctx_t& code_ctx) const override;
     type_t type() const override { return type_t::stmt_include; }
-    std::shared_ptr<stmt_t> parse_file(env_n::env_sptr_t env, options_t& options, const std::string& filename);
+    static stmt_t* include(env_n::env_sptr_t env, options_t& options, const std::string& filename);
+    static stmt_t* parse_file(env_n::env_sptr_t env, options_t& options, const std::string& filename);
   };
 
 
@@ -251,7 +270,7 @@ namespace aml::stmt_n {
 
 
   struct stmt_syscall_t : stmt_t {
-    std::vector<std::shared_ptr<stmt_t>> args;
+    stmts_t args = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -262,7 +281,7 @@ namespace aml::stmt_n {
 
 
   struct stmt_var_t : stmt_t {
-    env_n::var_info_sptr_t var;
+    env_n::var_info_sptr_t var = {};
 
     bool parse_v(const lisp_tree_n::lisp_tree_t& tree, env_n::env_sptr_t env, options_t& options) override;
     std::string show(size_t deep) const override;
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <deque>
-#include <regex>
+#include <limits>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <variant>
+#include <vector>
 
 #include "utils.h"
 
@@ -13,22 +16,43 @@ namespace aml::token_n {
 
 
   struct pos_t {
-    size_t line   = utils_n::line_start;
-    size_t column = utils_n::column_start;
-    size_t length = 0;
+    uint32_t line   = utils_n::line_start;
+    uint32_t column = utils_n::column_start;
+    uint32_t length = 0;
 
     std::string show() const;
   };
 
 
 
+  // interned identifier, symbols are compared by id, the name points into symbols_t
+  struct symbol_t {
+    static inline const uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    uint32_t         id   = npos;
+    std::string_view name = {};
+
+    bool operator==(const symbol_t& other) const { return id == other.id; }
+  };
+
+  struct symbols_t {
+    std::deque<std::string>                        names;
+    std::unordered_map<std::string_view, uint32_t> ids;
+
+    symbol_t intern(std::string_view name);
+  };
+
+
+
+  // tokens reference the source buffer, it has to outlive them
   using value_t = std::variant<
     int64_t,
-    std::string>;
+    std::string_view,
+    symbol_t>;
 
 
 
-  enum class type_t {
+  enum class type_t : uint8_t {
     unknown,
     new_line,
     whitespace,
@@ -54,112 +78,36 @@ namespace aml::token_n {
 
 
   struct token_t {
-    type_t      type   = type_t::unknown;
-    pos_t       pos    = {};
-    std::string lexeme = {};
-    value_t     value  = {};
+    type_t           type   = type_t::unknown;
+    pos_t            pos    = {};
+    std::string_view lexeme = {};
+    value_t          value  = {};
 
     bool is_primary() const;
     std::string show() const;
-    bool next(std::string::const_iterator& it, std::string::const_iterator ite);
+    bool next(std::string::const_iterator& it, std::string::const_iterator ite, symbols_t& symbols);
   };
 
-  using tokens_t = std::deque<token_t>;
-
-
-
-  struct rule_t {
-    using value_cb_t = std::function<value_t(const std::string&)>;
-
-    type_t     type;
-    std::regex regex;
-    value_cb_t get_value;
-  };
+  using tokens_t = std::vector<token_t>;
 
 
 
-  static inline std::vector<rule_t> rules = {
-    {
-      type_t::new_line,
-      std::regex(R"(\n)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::whitespace,
-      std::regex(R"([ \t]+)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::whitespace,
-      std::regex(R"(;[^\n]*)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::lp,
-      std::regex(R"(\()"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::rp,
-      std::regex(R"(\))"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_arg,
-      std::regex(R"(arg)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_block,
-      std::regex(R"(block)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_call,
-      std::regex(R"(call)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_defn,
-      std::regex(R"(defn)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_defvar,
-      std::regex(R"(defvar)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_func,
-      std::regex(R"(func)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_if,
-      std::regex(R"(if)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_include,
-      std::regex(R"(#include)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_int,
-      std::regex(R"(int)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_syscall,
-      std::regex(R"(syscall)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::key_var,
-      std::regex(R"(var)"),
-      [](const std::string&) { return value_t{}; },
-    }, {
-      type_t::integer,
-      std::regex(R"([-+]?\d+)"),
-      [](const std::string& lexeme) { return stol(lexeme); },
-    }, {
-      type_t::ident,
-      std::regex(R"([\w<=>&|+\-\!:*^\/]+)"),
-      [](const std::string& lexeme) { return lexeme; },
-    }, {
-      type_t::dq_string,
-      std::regex(R"(".*?")"),
-      [](const std::string& lexeme) { return lexeme.substr(1, lexeme.size() - 2); },
-    },
+  // keywords are recognized after the longest ident run, so "if" is a keyword and "iff" is an ident
+  static inline const std::vector<std::pair<std::string, type_t>> keywords = {
+    {"arg",     type_t::key_arg},
+    {"block",   type_t::key_block},
+    {"call",    type_t::key_call},
+    {"defn",    type_t::key_defn},
+    {"defvar",  type_t::key_defvar},
+    {"func",    type_t::key_func},
+    {"if",      type_t::key_if},
+    {"int",     type_t::key_int},
+    {"syscall", type_t::key_syscall},
+    {"var",     type_t::key_var},
   };
 
 
 
   std::string show_tokens(const tokens_t& tokens);
-  tokens_t process(const std::string& code);
+  tokens_t process(const std::string& code, symbols_t& symbols);
 }
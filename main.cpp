@@ -8,14 +8,25 @@ bool parse(aml::aml_n::options_t& options, int argc, char* argv[]) {
 
     options_description desc{"Options"};
     desc.add_options()
-      ("help,h",                                   "Help screen")
-      ("file_input",  value(&options.file_input),  "Read from file")
-      ("file_output", value(&options.file_output), "Write to file. Stdout is used if file is -")
-      ("input",       value(&options.input),       "code")
-      ("cmd",         value(&options.cmd),         "Availible commands \"compile\" and \"execute\"")
-      ("log",         value(&options.file_log),    "Write verbose output to file. Stdout is used if file is -")
-      ("level",       value(&options.level),       "Log levels: \"trace\", \"debug\", \"info\", \"warning\", \"error\", \"critical\" \"off\"")
-      ("filename",    value(&options.filename),    "Filename used if file_input not set.")
+      ("help,h",                                             "Help screen")
+      ("file_input",       value(&options.file_input),       "Read from file")
+      ("file_output",      value(&options.file_output),      "Write to file. Stdout is used if file is -")
+      ("input",            value(&options.input),            "code")
+      ("cmd",              value(&options.cmd),              "Availible commands \"compile\", \"execute\" and \"batch\"")
+      ("log",              value(&options.file_log),         "Write verbose output to file. Stdout is used if file is -")
+      ("level",            value(&options.level),            "Log levels: \"trace\", \"debug\", \"info\", \"warning\", \"error\", \"critical\" \"off\"")
+      ("filename",         value(&options.filename),         "Filename used if file_input not set.")
+      ("stack_capacity",   value(&options.stack_capacity),   "Stack capacity in int64 slots used by \"execute\"")
+      ("heap_capacity",    value(&options.heap_capacity),    "Capacity in int64 elements of the arrays of a stack used by \"execute\" and \"batch\"")
+      ("budget",           value(&options.budget),           "Max cmds executed by \"execute\" and per row of \"batch\", the program fails past it")
+      ("inline_threshold", value(&options.inline_threshold), "Max size of inlined defn bodies in stmts, 0 disables inlining")
+      ("fold",             value(&options.fold),             "Fold constant operators, if conditions and blocks, 0 disables folding")
+      ("memoize",          value(&options.memoize),          "Emit memo cmds for pure defns calling other defns (compile/run)")
+      ("jobs",             value(&options.jobs),             "Threads generating the code of defns, large programs only, and executing the rows of \"batch\"")
+      ("encoding",         value(&options.encoding),         "Bytecode encoding written by \"compile\": \"packed\" or \"aligned\"")
+      ("profile",          value(&options.profile),          "Count instructions of \"execute\" per cmd and function, print a report and write collapsed stacks to file")
+      ("rows",             value(&options.rows),             "Args of \"batch\", a row of int64 per line. Stdin is used if file is -")
+      ("module_cache",     value(&options.module_cache),     "Directory of parsed #include'd files, reused while their content is unchanged")
       ;
 
     variables_map vm;
@@ -1,13 +1,15 @@
 #include "aml.h"
 
+#include <fstream>
 #include <iostream>
+#include "batch.h"
 #include "logger.h"
 
 namespace aml::aml_n {
 
-  token_n::tokens_t lexical_analyzer_n::process(const std::string& code) {
+  token_n::tokens_t lexical_analyzer_n::process(const std::string& code, token_n::symbols_t& symbols) {
     AML_TRACER;
-    auto tokens = token_n::process(code);
+    auto tokens = token_n::process(code, symbols);
 
     AML_LOGGER(info, "source code:\n{}", code);
     AML_LOGGER(info, "tokens:\n{}", token_n::show_tokens(tokens));
@@ -26,9 +28,10 @@ namespace aml::aml_n {
 
 
 
-  std::shared_ptr<stmt_n::stmt_t> syntax_analyzer_n::process(const lisp_tree_n::lisp_tree_t& tree, const std::string& filename) {
+  stmt_n::stmt_t* syntax_analyzer_n::process(const lisp_tree_n::lisp_tree_t& tree, const std::string& filename, token_n::symbols_t& symbols, arena_n::arena_t& arena,
+      const std::string& module_cache) {
     AML_TRACER;
-    auto options = stmt_n::options_t{.filename = filename};
+    auto options = stmt_n::options_t{.filename = filename, .symbols = &symbols, .arena = &arena, .module_cache = module_cache};
     auto stmt = stmt_n::stmt_t::parse(tree, nullptr, {stmt_n::type_t::stmt_program}, options);
 
     AML_LOGGER(info, "stmt:\n{}", stmt->show({}));
@@ -37,9 +40,44 @@ namespace aml::aml_n {
 
 
 
-  code_n::code_ctx_t intermediate_code_generator_n::process(std::shared_ptr<stmt_n::stmt_t> stmt) {
+  size_t inliner_n::process(stmt_n::stmt_t* stmt, size_t threshold, arena_n::arena_t& arena) {
+    AML_TRACER;
+    auto inlined = optimizer_n::inline_calls(stmt, threshold, arena);
+
+    AML_LOGGER(info, "inlined calls: {}", inlined);
+    if (inlined)
+      AML_LOGGER(info, "stmt inlined:\n{}", stmt->show({}));
+    return inlined;
+  }
+
+
+
+  size_t constant_folder_n::process(stmt_n::stmt_t* stmt, arena_n::arena_t& arena) {
+    AML_TRACER;
+    auto folded = optimizer_n::fold_constants(stmt, arena);
+
+    AML_LOGGER(info, "folded stmts: {}", folded);
+    if (folded)
+      AML_LOGGER(info, "stmt folded:\n{}", stmt->show({}));
+    return folded;
+  }
+
+
+
+  size_t purity_analyzer_n::process(stmt_n::stmt_t* stmt, bool memoize) {
+    AML_TRACER;
+    auto pure = optimizer_n::mark_pure(stmt, memoize);
+
+    AML_LOGGER(info, "pure defns: {}", pure);
+    return pure;
+  }
+
+
+
+  code_n::code_ctx_t intermediate_code_generator_n::process(stmt_n::stmt_t* stmt, size_t jobs) {
     AML_TRACER;
     code_n::code_ctx_t code_ctx;
+    code_ctx.jobs = jobs;
     stmt->intermediate_code(code_ctx);
 
     AML_LOGGER(info, "intermediate code:\n{}", code_ctx.code.show());
@@ -48,18 +86,35 @@ namespace aml::aml_n {
 
 
 
-  std::string executor_n::process(const code_n::code_ctx_t& code_ctx) {
+  std::string executor_n::process(const image_n::image_t& image, size_t stack_capacity, size_t heap_capacity,
+      size_t budget, profile_n::profile_t* profile) {
     AML_TRACER;
-    code_n::stack_t stack;
-    stack.rip = code_ctx.rip;
+    code_n::program_t program;
+    image.prepare(program);
+    AML_LOGGER(info, "program:\n{}", program.show());
+
+    code_n::stack_t stack(stack_capacity, heap_capacity);
+    stack.rip = program.rip;
     stack.rbp = {};
 
-    for (size_t i{}; i < 1000000; ++i) {
-      if (!stack.step(code_ctx.code)) {
-        break;
+    bool completed = false;
+    size_t limit = budget;
+    if (profile) {
+      profile->prepare(program, image.labels());
+      completed = stack.run(program, budget, *profile);
+    } else if (logger_n::logger_t::level <= spdlog::level::debug) {
+      for (size_t i{}; i < budget && !completed; ++i) {
+        completed = !stack.step(program);
       }
+    } else {
+      // a yield only ends a time slice of a scheduler, a single program goes on
+      while (!(completed = stack.run(program, budget)) && stack.yield) { }
     }
 
+    // a program cut off by the budget is an error, not the value left on its stack
+    if (!completed)
+      throw utils_n::fatal_error_t("budget of " + std::to_string(limit) + " cmds is exhausted");
+
     return stack.size() == 1
       ? std::to_string(stack.get({}))
       : "invalid output";
@@ -69,18 +124,32 @@ namespace aml::aml_n {
 
   std::string options_t::show() {
     std::stringstream ss;
-    ss << "file_input:  " << file_input  << std::endl;
-    ss << "file_output: " << file_output << std::endl;
-    ss << "input:       " << input       << std::endl;
-    ss << "output:      " << output      << std::endl;
-    ss << "filename:    " << filename    << std::endl;
-    ss << "file_log:    " << file_log    << std::endl;
-    ss << "cmd:         " << cmd         << std::endl;
+    ss << "file_input:       " << file_input       << std::endl;
+    ss << "file_output:      " << file_output      << std::endl;
+    ss << "input:            " << input            << std::endl;
+    ss << "output:           " << output           << std::endl;
+    ss << "filename:         " << filename         << std::endl;
+    ss << "file_log:         " << file_log         << std::endl;
+    ss << "cmd:              " << cmd              << std::endl;
+    ss << "module_cache:     " << module_cache     << std::endl;
+    ss << "stack_capacity:   " << stack_capacity   << std::endl;
+    ss << "heap_capacity:    " << heap_capacity    << std::endl;
+    ss << "budget:           " << budget           << std::endl;
+    ss << "inline_threshold: " << inline_threshold << std::endl;
+    ss << "inlined:          " << inlined          << std::endl;
+    ss << "fold:             " << fold             << std::endl;
+    ss << "folded:           " << folded           << std::endl;
+    ss << "memoize:          " << memoize          << std::endl;
+    ss << "pure:             " << pure             << std::endl;
+    ss << "jobs:             " << jobs             << std::endl;
+    ss << "encoding:         " << encoding         << std::endl;
+    ss << "profile:          " << profile          << std::endl;
+    ss << "rows:             " << rows             << std::endl;
     return ss.str();
   }
 
   void options_t::preprocessing() {
-    if (!file_input.empty())
+    if (!file_input.empty() && cmd != "execute")
       input = utils_n::str_from_file(file_input);
     if (filename.empty()) {
       filename = !file_input.empty()
@@ -94,21 +163,37 @@ namespace aml::aml_n {
       std::cout << output;
     } else if (!file_output.empty())
       utils_n::str_to_file(output, file_output);
+    if (!report.empty())
+      std::cerr << report;
   }
 
 
 
+  static code_n::code_ctx_t generate(options_t& options) {
+    AML_TRACER;
+    if (options.encoding != "packed" && options.encoding != "aligned")
+      throw utils_n::fatal_error_t("unknown encoding '" + options.encoding + "'");
+    token_n::symbols_t symbols;
+    arena_n::arena_t   arena;
+    auto code      = options.input;
+    auto tokens    = lexical_analyzer_n::process(code, symbols);
+    auto lisp_tree = syntax_lisp_analyzer_n::process(tokens);
+    auto stmt      = syntax_analyzer_n::process(lisp_tree, options.filename, symbols, arena, options.module_cache);
+    options.inlined = inliner_n::process(stmt, options.inline_threshold, arena);
+    options.folded  = options.fold ? constant_folder_n::process(stmt, arena) : 0;
+    options.pure    = purity_analyzer_n::process(stmt, options.memoize);
+    return intermediate_code_generator_n::process(stmt, options.jobs);
+  }
+
   bool compile(options_t& options) {
     AML_TRACER;
     options.preprocessing();
 
     try {
-      auto code      = options.input;
-      auto tokens    = lexical_analyzer_n::process(code);
-      auto lisp_tree = syntax_lisp_analyzer_n::process(tokens);
-      auto stmt      = syntax_analyzer_n::process(lisp_tree, options.filename);
-      auto code_ctx  = intermediate_code_generator_n::process(stmt);
-      options.output = code_ctx.save();
+      auto code_ctx  = generate(options);
+      options.output = image_n::save(code_ctx, options.encoding == "aligned"
+          ? code_n::encoding_t::aligned
+          : code_n::encoding_t::packed);
     } catch (const std::exception& ex) {
       AML_LOGGER(err, "exception: {}", ex.what());
       options.errors = ex.what();
@@ -126,11 +211,19 @@ namespace aml::aml_n {
     options.preprocessing();
 
     try {
-      code_n::code_ctx_t code_ctx;
-      auto code = options.input;
-      code_ctx.load(code);
-      auto output = executor_n::process(code_ctx);
-      options.output = output;
+      // a file is mapped and decoded in place, without reading it into options.input
+      auto image = options.file_input.empty()
+        ? image_n::image_t::view(options.input)
+        : image_n::image_t::map(options.file_input);
+      if (options.profile.empty()) {
+        options.output = executor_n::process(*image, options.stack_capacity, options.heap_capacity, options.budget);
+      } else {
+        profile_n::profile_t profile;
+        options.output = executor_n::process(*image, options.stack_capacity, options.heap_capacity, options.budget, &profile);
+        options.report = profile.report();
+        AML_LOGGER(info, "profile:\n{}", options.report);
+        utils_n::str_to_file(profile.collapsed(), options.profile);
+      }
     } catch (const std::exception& ex) {
       AML_LOGGER(err, "exception: {}", ex.what());
       options.errors = ex.what();
@@ -143,6 +236,72 @@ namespace aml::aml_n {
 
 
 
+  bool batch(options_t& options) {
+    AML_TRACER;
+    auto program = load_program(options);
+    if (!program)
+      return false;
+
+    try {
+      // rows are streamed in blocks, a line of whitespace separated int64 args in, a result or an error out
+      std::ifstream file_rows;
+      if (options.rows != "-")
+        file_rows.open(options.rows);
+      std::istream& in = options.rows == "-" ? std::cin : file_rows;
+      if (!in)
+        throw utils_n::fatal_error_t("can not open rows '" + options.rows + "'");
+
+      std::ofstream file_output;
+      std::stringstream str_output;
+      if (!options.file_output.empty() && options.file_output != "-")
+        file_output.open(options.file_output);
+      std::ostream& out = options.file_output == "-" ? std::cout
+        : options.file_output.empty() ? static_cast<std::ostream&>(str_output) : file_output;
+
+      std::vector<int64_t>  rows;
+      std::vector<result_t> results;
+      size_t arity = std::string::npos;
+      std::string line;
+      for (bool eof = false; !eof; ) {
+        rows.clear();
+        size_t count = {};
+        while (count < executor_n::batch_rows && !(eof = !std::getline(in, line))) {
+          std::stringstream ss(line);
+          size_t size = rows.size();
+          for (int64_t value; ss >> value; )
+            rows.push_back(value);
+          if (!ss.eof())
+            throw utils_n::fatal_error_t("invalid row '" + line + "'");
+          if (arity == std::string::npos)
+            arity = rows.size() - size;
+          if (rows.size() - size != arity)
+            throw utils_n::fatal_error_t("row '" + line + "' has not " + std::to_string(arity) + " args");
+          count++;
+        }
+
+        results.assign(count, {});
+        execute_batch(*program, rows, arity, results, options.jobs, options.stack_capacity,
+            options.heap_capacity, options.budget);
+        for (const auto& result : results) {
+          if (result)
+            out << result.value << '\n';
+          else
+            out << "error: " << result.error << '\n';
+        }
+      }
+      out.flush();
+      options.output = str_output.str();
+    } catch (const std::exception& ex) {
+      AML_LOGGER(err, "exception: {}", ex.what());
+      options.errors = ex.what();
+      return false;
+    }
+
+    return true;
+  }
+
+
+
   bool run(options_t& options) {
     logger_n::logger_t::init(options.file_log, options.level);
     AML_TRACER;
@@ -151,9 +310,120 @@ namespace aml::aml_n {
       return compile(options);
     } else if (options.cmd == "execute") {
       return execute(options);
+    } else if (options.cmd == "batch") {
+      return batch(options);
     } else {
       options.errors = "unknown cmd";
       return false;
     }
   }
+
+
+
+  program_sptr_t compile_program(options_t& options) {
+    AML_TRACER;
+    options.preprocessing();
+
+    try {
+      auto code_ctx = generate(options);
+      auto program  = std::make_shared<program_t>();
+      program->code.prepare(code_ctx);
+      program->labels = std::move(code_ctx.labels);
+      return program;
+    } catch (const std::exception& ex) {
+      AML_LOGGER(err, "exception: {}", ex.what());
+      options.errors = ex.what();
+      return {};
+    }
+  }
+
+  program_sptr_t load_program(options_t& options) {
+    AML_TRACER;
+
+    try {
+      // a file is mapped and decoded in place, as execute does
+      auto image = options.file_input.empty()
+        ? image_n::image_t::view(options.input)
+        : image_n::image_t::map(options.file_input);
+      auto program = std::make_shared<program_t>();
+      image->prepare(program->code);
+      program->labels = image->labels();
+      return program;
+    } catch (const std::exception& ex) {
+      AML_LOGGER(err, "exception: {}", ex.what());
+      options.errors = ex.what();
+      return {};
+    }
+  }
+
+
+
+  result_t execute(const program_t& program, std::span<const int64_t> args, code_n::stack_t& stack, size_t fuel) {
+    // the top level expression runs in a frame of its own, as if it was called with args
+    try {
+      // cached results are keyed by the ids of defns of the program executed last, arrays live for an execution
+      stack.memo.clear();
+      stack.heap.clear();
+      stack.resize({});
+      for (auto it = args.rbegin(); it != args.rend(); ++it)
+        stack.push_back(*it);
+      stack.push_back(static_cast<int64_t>(args.size()));
+      stack.push_back({});   // rbp
+      stack.push_back({});   // rip
+      stack.rbp = stack.size();
+      stack.rip = program.code.rip;
+    } catch (const std::exception& ex) {
+      return {.status = status_t::error, .error = ex.what()};
+    }
+
+    return resume(program, stack, fuel);
+  }
+
+  result_t resume(const program_t& program, code_n::stack_t& stack, size_t fuel) {
+    // the vm stops before a cmd when the fuel runs out or after a yield, rip and the stack are left as they are
+    try {
+      if (stack.rip >= program.code.cmds.size())
+        return {.status = status_t::error, .error = "execution is not suspended"};
+      size_t left = fuel;
+      if (!stack.run(program.code, left))
+        return {.status = status_t::suspended, .cmds = fuel - left};
+      stack.rip = program.code.cmds.size();
+      if (stack.size() != stack.rbp + 1)
+        return {.status = status_t::invalid_output, .error = "invalid output", .cmds = fuel - left};
+      return {.value = stack.back(), .cmds = fuel - left};
+    } catch (const std::exception& ex) {
+      stack.rip = program.code.cmds.size();
+      return {.status = status_t::error, .error = ex.what()};
+    }
+  }
+
+  result_t execute(const program_t& program, std::span<const int64_t> args) {
+    static thread_local code_n::stack_t stack;
+    return execute(program, args, stack);
+  }
+
+  void execute_batch(const program_t& program, std::span<const int64_t> rows, size_t arity, std::span<result_t> results,
+      size_t jobs, size_t stack_capacity, size_t heap_capacity, size_t budget) {
+    AML_TRACER;
+    if (rows.size() != results.size() * arity)
+      throw utils_n::fatal_error_t("execute_batch: " + std::to_string(rows.size()) + " args for "
+          + std::to_string(results.size()) + " rows of " + std::to_string(arity));
+
+    // the program is only read, stacks are created by their workers on first use
+    std::vector<std::unique_ptr<code_n::stack_t>> stacks(std::max<size_t>(jobs, 1));
+    batch_n::process(results.size(), jobs, executor_n::batch_grain, [&](size_t worker, size_t begin, size_t end) {
+      auto& stack = stacks[worker];
+      if (!stack)
+        stack = std::make_unique<code_n::stack_t>(stack_capacity, heap_capacity);
+      for (size_t i = begin; i < end; ++i) {
+        results[i] = execute(program, rows.subspan(i * arity, arity), *stack, budget);
+        for (size_t left = budget - results[i].cmds; results[i].status == status_t::suspended && stack->yield; ) {
+          results[i] = resume(program, *stack, left);
+          left -= results[i].cmds;
+        }
+        if (results[i].status == status_t::suspended)
+          results[i] = {.status = status_t::error, .error = "budget of " + std::to_string(budget) + " cmds is exhausted"};
+      }
+    });
+  }
 }
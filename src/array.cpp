@@ -0,0 +1,368 @@
+#include "array.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AML_X86 1
+#endif
+
+namespace aml::array_n {
+  // the arithmetic is done on uint64, overflows wrap the same way in every isa
+  static inline int64_t wrap_add(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+  }
+
+  static inline int64_t wrap_mul(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b));
+  }
+
+
+
+  namespace scalar_n {
+    static int64_t sum(const int64_t* a, size_t n) {
+      int64_t value = {};
+      for (size_t i{}; i < n; ++i)
+        value = wrap_add(value, a[i]);
+      return value;
+    }
+
+    static int64_t min(const int64_t* a, size_t n) {
+      return n ? *std::min_element(a, a + n) : 0;
+    }
+
+    static int64_t max(const int64_t* a, size_t n) {
+      return n ? *std::max_element(a, a + n) : 0;
+    }
+
+    static int64_t dot(const int64_t* a, const int64_t* b, size_t n) {
+      int64_t value = {};
+      for (size_t i{}; i < n; ++i)
+        value = wrap_add(value, wrap_mul(a[i], b[i]));
+      return value;
+    }
+
+    static void add(int64_t* dst, const int64_t* a, const int64_t* b, size_t n) {
+      for (size_t i{}; i < n; ++i)
+        dst[i] = wrap_add(a[i], b[i]);
+    }
+
+    static void mul(int64_t* dst, const int64_t* a, const int64_t* b, size_t n) {
+      for (size_t i{}; i < n; ++i)
+        dst[i] = wrap_mul(a[i], b[i]);
+    }
+
+    static void prefix_sum(int64_t* a, size_t n) {
+      for (size_t i = 1; i < n; ++i)
+        a[i] = wrap_add(a[i - 1], a[i]);
+    }
+
+    // every isa sorts with introsort, the lanes of sse and avx2 are too few for a sorting network to pay off
+    static void sort(int64_t* a, size_t n) {
+      std::sort(a, a + n);
+    }
+  }
+
+
+
+#ifdef AML_X86
+  // the vector loops leave the tail of n % lanes elements to the scalar ones
+  namespace sse_n {
+    template <typename T>
+    static inline __m128i load(T* p) {
+      return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    }
+
+    static inline int64_t lane(__m128i x, int i) {
+      alignas(16) int64_t lanes[2];
+      _mm_store_si128(reinterpret_cast<__m128i*>(lanes), x);
+      return lanes[i];
+    }
+
+    __attribute__((target("sse4.2")))
+    static int64_t sum(const int64_t* a, size_t n) {
+      __m128i acc0 = _mm_setzero_si128();
+      __m128i acc1 = _mm_setzero_si128();
+      size_t i{};
+      for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_epi64(acc0, load(a + i));
+        acc1 = _mm_add_epi64(acc1, load(a + i + 2));
+      }
+      __m128i acc = _mm_add_epi64(acc0, acc1);
+      return wrap_add(wrap_add(lane(acc, 0), lane(acc, 1)), scalar_n::sum(a + i, n - i));
+    }
+
+    template <bool is_min>
+    __attribute__((target("sse4.2")))
+    static int64_t extreme(const int64_t* a, size_t n) {
+      if (n < 2)
+        return is_min ? scalar_n::min(a, n) : scalar_n::max(a, n);
+      __m128i acc = load(a);
+      size_t i = 2;
+      for (; i + 2 <= n; i += 2) {
+        __m128i x  = load(a + i);
+        __m128i gt = _mm_cmpgt_epi64(acc, x);
+        acc = is_min ? _mm_blendv_epi8(acc, x, gt) : _mm_blendv_epi8(x, acc, gt);
+      }
+      int64_t lanes[] = {lane(acc, 0), lane(acc, 1)};
+      int64_t value = is_min ? std::min(lanes[0], lanes[1]) : std::max(lanes[0], lanes[1]);
+      for (; i < n; ++i)
+        value = is_min ? std::min(value, a[i]) : std::max(value, a[i]);
+      return value;
+    }
+  }
+
+
+
+  namespace avx2_n {
+    template <typename T>
+    __attribute__((target("avx2")))
+    static inline __m256i load(T* p) {
+      return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    }
+
+    __attribute__((target("avx2")))
+    static inline void store(int64_t* p, __m256i x) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), x);
+    }
+
+    __attribute__((target("avx2")))
+    static inline int64_t hsum(__m256i x) {
+      alignas(32) int64_t lanes[4];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), x);
+      return wrap_add(wrap_add(lanes[0], lanes[1]), wrap_add(lanes[2], lanes[3]));
+    }
+
+    // the low 64 bits of the products, from the 32 bit halves avx2 multiplies
+    __attribute__((target("avx2")))
+    static inline __m256i mul64(__m256i a, __m256i b) {
+      __m256i lo    = _mm256_mul_epu32(a, b);
+      __m256i cross = _mm256_add_epi64(
+          _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+      return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+    }
+
+    __attribute__((target("avx2")))
+    static int64_t sum(const int64_t* a, size_t n) {
+      __m256i acc0 = _mm256_setzero_si256();
+      __m256i acc1 = _mm256_setzero_si256();
+      size_t i{};
+      for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_epi64(acc0, load(a + i));
+        acc1 = _mm256_add_epi64(acc1, load(a + i + 4));
+      }
+      return wrap_add(hsum(_mm256_add_epi64(acc0, acc1)), scalar_n::sum(a + i, n - i));
+    }
+
+    template <bool is_min>
+    __attribute__((target("avx2")))
+    static int64_t extreme(const int64_t* a, size_t n) {
+      if (n < 4)
+        return is_min ? scalar_n::min(a, n) : scalar_n::max(a, n);
+      __m256i acc = load(a);
+      size_t i = 4;
+      for (; i + 4 <= n; i += 4) {
+        __m256i x  = load(a + i);
+        __m256i gt = _mm256_cmpgt_epi64(acc, x);
+        acc = is_min ? _mm256_blendv_epi8(acc, x, gt) : _mm256_blendv_epi8(x, acc, gt);
+      }
+      alignas(32) int64_t lanes[4];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+      int64_t value = is_min ? scalar_n::min(lanes, 4) : scalar_n::max(lanes, 4);
+      for (; i < n; ++i)
+        value = is_min ? std::min(value, a[i]) : std::max(value, a[i]);
+      return value;
+    }
+
+    __attribute__((target("avx2")))
+    static int64_t dot(const int64_t* a, const int64_t* b, size_t n) {
+      __m256i acc = _mm256_setzero_si256();
+      size_t i{};
+      for (; i + 4 <= n; i += 4)
+        acc = _mm256_add_epi64(acc, mul64(load(a + i), load(b + i)));
+      return wrap_add(hsum(acc), scalar_n::dot(a + i, b + i, n - i));
+    }
+
+    __attribute__((target("avx2")))
+    static void add(int64_t* dst, const int64_t* a, const int64_t* b, size_t n) {
+      size_t i{};
+      for (; i + 4 <= n; i += 4)
+        store(dst + i, _mm256_add_epi64(load(a + i), load(b + i)));
+      scalar_n::add(dst + i, a + i, b + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void mul(int64_t* dst, const int64_t* a, const int64_t* b, size_t n) {
+      size_t i{};
+      for (; i + 4 <= n; i += 4)
+        store(dst + i, mul64(load(a + i), load(b + i)));
+      scalar_n::mul(dst + i, a + i, b + i, n - i);
+    }
+  }
+#endif
+
+
+
+  // a kernel is vectorized where it beats the scalar loop, the compiler vectorizes the plain adds itself:
+  // the 64 bit products are emulated from 32 bit ones, which 2 lanes do not pay off, and a scan is bound by its carry
+  static const kernels_t kernels_scalar = {
+    .sum        = scalar_n::sum,
+    .min        = scalar_n::min,
+    .max        = scalar_n::max,
+    .dot        = scalar_n::dot,
+    .add        = scalar_n::add,
+    .mul        = scalar_n::mul,
+    .prefix_sum = scalar_n::prefix_sum,
+    .sort       = scalar_n::sort,
+  };
+
+#ifdef AML_X86
+  static const kernels_t kernels_sse = {
+    .sum        = sse_n::sum,
+    .min        = sse_n::extreme<true>,
+    .max        = sse_n::extreme<false>,
+    .dot        = scalar_n::dot,
+    .add        = scalar_n::add,
+    .mul        = scalar_n::mul,
+    .prefix_sum = scalar_n::prefix_sum,
+    .sort       = scalar_n::sort,
+  };
+
+  static const kernels_t kernels_avx2 = {
+    .sum        = avx2_n::sum,
+    .min        = avx2_n::extreme<true>,
+    .max        = avx2_n::extreme<false>,
+    .dot        = avx2_n::dot,
+    .add        = avx2_n::add,
+    .mul        = avx2_n::mul,
+    .prefix_sum = scalar_n::prefix_sum,
+    .sort       = scalar_n::sort,
+  };
+#endif
+
+  std::string show(isa_t isa) {
+    switch (isa) {
+      case isa_t::scalar: return "scalar";
+      case isa_t::sse:    return "sse";
+      case isa_t::avx2:   return "avx2";
+    }
+    return "unknown";
+  }
+
+  bool supported(isa_t isa) {
+    switch (isa) {
+      case isa_t::scalar: return true;
+#ifdef AML_X86
+      case isa_t::sse:    return __builtin_cpu_supports("sse4.2");
+      case isa_t::avx2:   return __builtin_cpu_supports("avx2");
+#else
+      default:            return false;
+#endif
+    }
+    return false;
+  }
+
+  static const isa_t isa_detected = supported(isa_t::avx2) ? isa_t::avx2
+    : supported(isa_t::sse) ? isa_t::sse
+    : isa_t::scalar;
+
+  isa_t isa_best() {
+    return isa_detected;
+  }
+
+  const kernels_t& kernels(isa_t isa) {
+    if (!supported(isa))
+      throw utils_n::fatal_error_t("array_n: " + show(isa) + " is not supported by the cpu");
+    switch (isa) {
+#ifdef AML_X86
+      case isa_t::sse:    return kernels_sse;
+      case isa_t::avx2:   return kernels_avx2;
+#endif
+      default:            return kernels_scalar;
+    }
+  }
+
+
+
+  int64_t heap_t::make(int64_t size) {
+    if (size < 0 || static_cast<size_t>(size) > capacity - used)
+      throw utils_n::fatal_error_t("array_n: array of size " + std::to_string(size)
+          + " exceeds the heap capacity of " + std::to_string(capacity));
+    if (count == arrays.size())
+      arrays.emplace_back();
+    arrays[count].assign(static_cast<size_t>(size), 0);
+    used += static_cast<size_t>(size);
+    return static_cast<int64_t>(count++);
+  }
+
+  std::span<int64_t> heap_t::at(int64_t handle) {
+    if (handle < 0 || static_cast<size_t>(handle) >= count)
+      throw utils_n::fatal_error_t("array_n: invalid handle " + std::to_string(handle));
+    return arrays[static_cast<size_t>(handle)];
+  }
+
+  int64_t heap_t::syscall(int64_t op, std::span<const int64_t> args) {
+    // args of the syscalls by their op, 0 for the unused ones
+    static constexpr std::array<size_t, syscall_last - syscall_first + 1> arity = {
+      /*400*/ 1, 2, 3, 1, 0, 0, 0, 0, 0, 0,
+      /*410*/ 1, 1, 1, 2, 2, 2, 1, 1,
+    };
+    if (op < syscall_first || op > syscall_last)
+      return -1;
+    auto expected = arity[static_cast<size_t>(op - syscall_first)];
+    if (!expected || args.size() != expected)
+      return -1;
+
+    auto index = [](std::span<int64_t> array, int64_t i) -> int64_t& {
+      if (i < 0 || static_cast<size_t>(i) >= array.size())
+        throw utils_n::fatal_error_t("array_n: index " + std::to_string(i)
+            + " is out of an array of size " + std::to_string(array.size()));
+      return array[static_cast<size_t>(i)];
+    };
+    auto pair = [this](int64_t a, int64_t b) {
+      auto x = at(a);
+      auto y = at(b);
+      if (x.size() != y.size())
+        throw utils_n::fatal_error_t("array_n: sizes of arrays differ, "
+            + std::to_string(x.size()) + " and " + std::to_string(y.size()));
+      return std::make_pair(x, y);
+    };
+    auto elementwise = [&](auto kernel) {
+      // the result is made before the spans of the sources are taken, a new array may move them
+      auto size   = static_cast<int64_t>(pair(args[0], args[1]).first.size());
+      auto handle = make(size);
+      auto [x, y] = pair(args[0], args[1]);
+      kernel(at(handle).data(), x.data(), y.data(), x.size());
+      return handle;
+    };
+
+    // the elements touched by the syscall, charged as cmds
+    size_t elements = {};
+    if (op >= static_cast<int64_t>(syscall_t::sum)) {
+      elements = at(args[0]).size();
+      if (op == static_cast<int64_t>(syscall_t::sort))
+        elements *= std::bit_width(elements);
+    } else if (op == static_cast<int64_t>(syscall_t::make) && args[0] > 0) {
+      elements = static_cast<size_t>(args[0]);
+    }
+    debt += elements / elements_per_cmd;
+
+    switch (static_cast<syscall_t>(op)) {
+      case syscall_t::make:       return make(args[0]);
+      case syscall_t::get:        return index(at(args[0]), args[1]);
+      case syscall_t::set:        return index(at(args[0]), args[1]) = args[2];
+      case syscall_t::size:       return static_cast<int64_t>(at(args[0]).size());
+      case syscall_t::sum:        { auto x = at(args[0]); return kernels->sum(x.data(), x.size()); }
+      case syscall_t::min:        { auto x = at(args[0]); return kernels->min(x.data(), x.size()); }
+      case syscall_t::max:        { auto x = at(args[0]); return kernels->max(x.data(), x.size()); }
+      case syscall_t::dot:        { auto [x, y] = pair(args[0], args[1]); return kernels->dot(x.data(), y.data(), x.size()); }
+      case syscall_t::add:        return elementwise(kernels->add);
+      case syscall_t::mul:        return elementwise(kernels->mul);
+      case syscall_t::prefix_sum: { auto x = at(args[0]); kernels->prefix_sum(x.data(), x.size()); return args[0]; }
+      case syscall_t::sort:       { auto x = at(args[0]); kernels->sort(x.data(), x.size()); return args[0]; }
+    }
+    return -1;
+  }
+}
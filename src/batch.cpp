@@ -0,0 +1,93 @@
+#include "batch.h"
+
+#include <thread>
+
+#include "logger.h"
+
+namespace aml::batch_n {
+  bool queue_t::take(size_t grain, size_t& first, size_t& last) {
+    std::lock_guard lock(mutex);
+    if (begin == end)
+      return false;
+    first = begin;
+    last  = begin = std::min(end, begin + grain);
+    return true;
+  }
+
+  bool queue_t::steal(queue_t& victim) {
+    size_t first;
+    size_t last;
+    {
+      std::lock_guard lock(victim.mutex);
+      size_t left = victim.end - victim.begin;
+      if (!left)
+        return false;
+      // a lone row is taken too, a thief spinning until its owner gets back to it would only contend the locks
+      first = victim.end - (left + 1) / 2;
+      last  = victim.end;
+      victim.end = first;
+    }
+
+    std::lock_guard lock(mutex);
+    begin = first;
+    end   = last;
+    return true;
+  }
+
+
+
+  void process(size_t count, size_t jobs, size_t grain, const task_t& task) {
+    AML_TRACER;
+    grain = std::max<size_t>(grain, 1);
+    jobs  = std::max<size_t>(std::min(jobs, (count + grain - 1) / grain), 1);
+    AML_LOGGER(debug, "count: {} jobs: {} grain: {}", count, jobs, grain);
+
+    // the rows are dealt out evenly, stealing only evens out the rows that run longer
+    std::vector<queue_t> queues(jobs);
+    for (size_t i{}; i < jobs; ++i) {
+      queues[i].begin = count * i / jobs;
+      queues[i].end   = count * (i + 1) / jobs;
+    }
+
+    std::vector<std::exception_ptr> errors(jobs);
+    auto worker = [&](size_t id) {
+      try {
+        auto& queue = queues[id];
+        for (;;) {
+          size_t first;
+          size_t last;
+          while (queue.take(grain, first, last))
+            task(id, first, last);
+
+          queue_t* victim = {};
+          size_t left = {};
+          for (auto& other : queues) {
+            std::lock_guard lock(other.mutex);
+            if (other.end - other.begin > left) {
+              left   = other.end - other.begin;
+              victim = &other;
+            }
+          }
+          if (!victim || !queue.steal(*victim)) {
+            if (!left)
+              break;
+          }
+        }
+      } catch (...) {
+        errors[id] = std::current_exception();
+      }
+    };
+
+    {
+      std::vector<std::jthread> threads;
+      for (size_t i = 1; i < jobs; ++i)
+        threads.emplace_back(worker, i);
+      worker(0);
+    }
+
+    for (const auto& error : errors) {
+      if (error)
+        std::rethrow_exception(error);
+    }
+  }
+}
@@ -1,9 +1,13 @@
 #include "code_segment.h"
 
-#include <functional>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
 
 #include "utils.h"
 #include "logger.h"
+#include "profile.h"
 
 namespace aml::code_n {
   namespace utils_n = aml::utils_n;
@@ -11,9 +15,10 @@ namespace aml::code_n {
 
 
   cmd_t::cmd_t(cmd_id_t cmd_id, int64_t value) {
-    bits.id  = static_cast<uint8_t>(cmd_id) & ((1 << 4) - 1);
+    bits.id  = static_cast<uint8_t>(std::min(cmd_id, cmd_id_t::extended)) & ((1 << 4) - 1);
     bits.ext = {};
     bits.len = {};
+    id  = cmd_id;
     val = value;
   }
 
@@ -23,13 +28,15 @@ namespace aml::code_n {
         static_cast<size_t>(bits.id), static_cast<size_t>(bits.ext), static_cast<size_t>(bits.len), cmd, val, show());
     bits.ext = {};
     bits.len = {};
-    switch (static_cast<cmd_id_t>(bits.id)) {
+    switch (id) {
       case cmd_id_t::arg:
       case cmd_id_t::jmp:
       case cmd_id_t::pop:
       case cmd_id_t::pop_jif:
       case cmd_id_t::push:
       case cmd_id_t::var:
+      case cmd_id_t::memo:
+      case cmd_id_t::memo_ret:
       {
         if (val >= -2 && val <= 5) {
           bits.ext = 1;
@@ -44,12 +51,26 @@ namespace aml::code_n {
       case cmd_id_t::exit:
       case cmd_id_t::ret:
       case cmd_id_t::syscall:
+      case cmd_id_t::add:
+      case cmd_id_t::sub:
+      case cmd_id_t::mul:
+      case cmd_id_t::div:
+      case cmd_id_t::eq:
+      case cmd_id_t::lt:
+      case cmd_id_t::land:
+      case cmd_id_t::lor:
+      case cmd_id_t::lnot:
+      case cmd_id_t::tail_call:
       {
+        // no operand, the short form keeps it out of the code
+        val = {};
+        bits.ext = 1;
+        bits.len = (val - -2) & ((1 << 3) - 1);
         break;
       }
       default:
       {
-        AML_LOGGER(err, "unknown cmd: {} {}", static_cast<uint8_t>(bits.id), show());
+        AML_LOGGER(err, "unknown cmd: {} {}", static_cast<uint8_t>(id), show());
         break;
       }
     }
@@ -68,45 +89,68 @@ namespace aml::code_n {
     AML_LOGGER(debug, "cmd after:  {} {:02x} {:08b} {}", static_cast<size_t>(bits.id), static_cast<size_t>(bits.id), cmd, val);
   }
 
+  std::string show(cmd_id_t id) {
+    switch (id) {
+      case cmd_id_t::arg:       return "arg";
+      case cmd_id_t::call:      return "call";
+      case cmd_id_t::exit:      return "exit";
+      case cmd_id_t::jmp:       return "jmp";
+      case cmd_id_t::pop_jif:   return "pop_jif";
+      case cmd_id_t::pop:       return "pop";
+      case cmd_id_t::push:      return "push";
+      case cmd_id_t::ret:       return "ret";
+      case cmd_id_t::syscall:   return "syscall";
+      case cmd_id_t::var:       return "var";
+      case cmd_id_t::add:       return "add";
+      case cmd_id_t::sub:       return "sub";
+      case cmd_id_t::mul:       return "mul";
+      case cmd_id_t::div:       return "div";
+      case cmd_id_t::eq:        return "eq";
+      case cmd_id_t::lt:        return "lt";
+      case cmd_id_t::land:      return "land";
+      case cmd_id_t::lor:       return "lor";
+      case cmd_id_t::lnot:      return "lnot";
+      case cmd_id_t::tail_call: return "tail_call";
+      case cmd_id_t::memo:      return "memo";
+      case cmd_id_t::memo_ret:  return "memo_ret";
+      default:                  return "unknown";
+    }
+  }
+
   std::string cmd_t::show() const {
-    std::string str;
-    switch (static_cast<cmd_id_t>(bits.id)) {
-      case cmd_id_t::arg:     str += "arg";     break;
-      case cmd_id_t::call:    str += "call";    break;
-      case cmd_id_t::exit:    str += "exit";    break;
-      case cmd_id_t::jmp:     str += "jmp";     break;
-      case cmd_id_t::pop_jif: str += "pop_jif"; break;
-      case cmd_id_t::pop:     str += "pop";     break;
-      case cmd_id_t::push:    str += "push";    break;
-      case cmd_id_t::ret:     str += "ret";     break;
-      case cmd_id_t::syscall: str += "syscall"; break;
-      case cmd_id_t::var:     str += "var";     break;
-      default: str += "unknown";
-    }
-    switch (static_cast<cmd_id_t>(bits.id)) {
-      case cmd_id_t::arg:     str += " " + std::to_string(val); break;
-      case cmd_id_t::call:                                      break;
-      case cmd_id_t::exit:                                      break;
-      case cmd_id_t::jmp:     str += " " + std::to_string(val); break;
-      case cmd_id_t::pop_jif: str += " " + std::to_string(val); break;
-      case cmd_id_t::pop:     str += " " + std::to_string(val); break;
-      case cmd_id_t::push:    str += " " + std::to_string(val); break;
-      case cmd_id_t::ret:                                       break;
-      case cmd_id_t::syscall:                                   break;
-      case cmd_id_t::var:     str += " " + std::to_string(val); break;
-      default: str += " unknown";
+    std::string str = code_n::show(id);
+    switch (id) {
+      case cmd_id_t::arg:       str += " " + std::to_string(val); break;
+      case cmd_id_t::jmp:       str += " " + std::to_string(val); break;
+      case cmd_id_t::pop_jif:   str += " " + std::to_string(val); break;
+      case cmd_id_t::pop:       str += " " + std::to_string(val); break;
+      case cmd_id_t::push:      str += " " + std::to_string(val); break;
+      case cmd_id_t::var:       str += " " + std::to_string(val); break;
+      case cmd_id_t::memo:      str += " " + std::to_string(val); break;
+      case cmd_id_t::memo_ret:  str += " " + std::to_string(val); break;
+      default:                                                    break;
     }
     return str;
   }
 
 
 
+  const native_t* find_native(int64_t syscall, size_t arity) {
+    auto it = std::find_if(natives.begin(), natives.end(),
+        [syscall, arity](const auto& native) { return native.syscall == syscall && native.arity == arity; });
+    return it != natives.end() ? &*it : nullptr;
+  }
+
+
+
+  // shifts of the encoded value are logical, a code of the top bit set is a valid one of a large int
   int64_t zigzag_encode(int64_t value) {
-    return (value << 1) ^ (value >> (8 * sizeof(int64_t) - 1));
+    return static_cast<int64_t>((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
   }
 
   int64_t zigzag_decode(int64_t value) {
-    return (value >> 1) ^ (-(value & 1));
+    auto code = static_cast<uint64_t>(value);
+    return static_cast<int64_t>((code >> 1) ^ (~(code & 1) + 1));
   }
 
   uint8_t zigzag_size(int64_t value) {
@@ -138,22 +182,51 @@ namespace aml::code_n {
     write(&data, sizeof(data), pos);
   }
 
-  void code_t::write_int(int64_t data, size_t size) {
+  void code_t::write_int(int64_t data, size_t size, size_t pos) {
     for (size_t i{}; i < size; ++i) {
-      write_u8(static_cast<uint8_t>(data & 0xFF));
+      uint8_t byte = static_cast<uint8_t>(data & 0xFF);
+      write(&byte, sizeof(byte), pos);
+      if (pos != std::string::npos) pos++;
       data >>= 8;
     }
   }
 
   void code_t::write_cmd(cmd_t cmd) {
     cmd.encode();
-    AML_LOGGER(debug, "cmd: {} {:08b} {} \t {}", static_cast<size_t>(cmd.bits.id), cmd.cmd, cmd.val, cmd.show());
+    AML_LOGGER(debug, "cmd: {} {:08b} {} \t {}", static_cast<size_t>(cmd.id), cmd.cmd, cmd.val, cmd.show());
     write_u8(cmd.cmd);
+    if (cmd.bits.id == static_cast<uint8_t>(cmd_id_t::extended)) {
+      write_u8(static_cast<uint8_t>(cmd.id));
+    }
     if (!cmd.bits.ext) {
       write_int(cmd.val, cmd.bits.len + 1);
     }
   }
 
+  size_t code_t::write_fixup(cmd_id_t cmd_id) {
+    cmd_t cmd = {cmd_id};
+    cmd.bits.len = (fixup_size - 1) & ((1 << 3) - 1);
+    AML_LOGGER(debug, "cmd: {} {:08b} fixup \t {}", static_cast<size_t>(cmd.id), cmd.cmd, cmd.show());
+    write_u8(cmd.cmd);
+    size_t fixup = buffer.size();
+    write_int({}, fixup_size);
+    return fixup;
+  }
+
+  void code_t::patch(size_t fixup) {
+    // the offset is relative to the end of the jump, as for write_cmd
+    int64_t offset = static_cast<int64_t>(buffer.size() - (fixup + fixup_size));
+    AML_LOGGER(debug, "fixup: {} offset: {}", fixup, offset);
+    resolve(fixup, offset);
+  }
+
+  void code_t::resolve(size_t fixup, int64_t value) {
+    int64_t val = zigzag_encode(value);
+    if (zigzag_size(val) > fixup_size)
+      throw utils_n::fatal_error_t("code_t: fixup value " + std::to_string(value) + " is too big");
+    write_int(val, fixup_size, fixup);
+  }
+
   void code_t::read(void* data, size_t size, size_t& pos) const {
     if (buffer.empty())
       return;
@@ -187,13 +260,29 @@ namespace aml::code_n {
   }
 
   cmd_t code_t::read_cmd(size_t& pos) const {
+    return code_n::read_cmd(buffer, pos);
+  }
+
+  cmd_t read_cmd(std::span<const uint8_t> buffer, size_t& pos) {
+    auto read_u8 = [&]() -> uint8_t {
+      uint8_t byte = pos < buffer.size() ? buffer[pos] : uint8_t{};
+      pos++;
+      return byte;
+    };
+
     cmd_t cmd = {};
-    cmd.cmd = read_u8(pos);
+    cmd.cmd = read_u8();
+    cmd.id  = cmd.bits.id == static_cast<uint8_t>(cmd_id_t::extended)
+      ? static_cast<cmd_id_t>(read_u8())
+      : static_cast<cmd_id_t>(cmd.bits.id);
     if (!cmd.bits.ext) {
-      cmd.val = read_int(pos, cmd.bits.len + 1);
+      uint64_t val = {};
+      for (size_t i{}; i < cmd.bits.len + 1u; ++i)
+        val |= static_cast<uint64_t>(read_u8()) << (8 * i);
+      cmd.val = static_cast<int64_t>(val);
     }
     cmd.decode();
-    AML_LOGGER(debug, "cmd: {} {:08b} {} \t {}", static_cast<size_t>(cmd.bits.id), cmd.cmd, cmd.val, cmd.show());
+    AML_LOGGER(debug, "cmd: {} {:08b} {} \t {}", static_cast<size_t>(cmd.id), cmd.cmd, cmd.val, cmd.show());
     return cmd;
   }
 
@@ -211,6 +300,80 @@ namespace aml::code_n {
 
 
 
+  void code_ctx_t::append(const code_ctx_t& other) {
+    auto base = code.buffer.size();
+    code.buffer.insert(code.buffer.end(), other.code.buffer.begin(), other.code.buffer.end());
+    for (auto reloc : other.relocs) {
+      reloc.fixup += base;
+      relocs.push_back(reloc);
+    }
+  }
+
+  void code_ctx_t::link() {
+    for (const auto& reloc : relocs) {
+      AML_LOGGER(debug, "reloc: {} offset: {}", reloc.fixup, *reloc.offset);
+      code.resolve(reloc.fixup, static_cast<int64_t>(*reloc.offset));
+    }
+  }
+
+
+
+  aligned_code_t align(const code_ctx_t& code_ctx) {
+    AML_TRACER;
+    const auto& buffer = code_ctx.code.buffer;
+
+    std::vector<cmd_t>  cmds;
+    std::vector<size_t> ends;
+    std::vector<size_t> index(buffer.size() + 1, program_t::npos);
+    size_t pos = {};
+    while (pos < buffer.size()) {
+      index[pos] = cmds.size();
+      cmds.push_back(read_cmd(buffer, pos));
+      ends.push_back(pos);
+    }
+    index[buffer.size()] = cmds.size();
+
+    auto target = [&](int64_t offset) {
+      if (offset < 0 || static_cast<size_t>(offset) >= index.size() || index[offset] == program_t::npos)
+        throw utils_n::fatal_error_t("code_n: invalid offset " + std::to_string(offset));
+      return index[offset];
+    };
+
+    // linked function addresses are the operands of the push cmds at the relocations
+    std::vector<bool> addresses(buffer.size());
+    for (const auto& reloc : code_ctx.relocs)
+      addresses[reloc.fixup - 1/*header*/] = true;
+
+    aligned_code_t aligned;
+    aligned.words.reserve(cmds.size());
+    for (size_t i{}; i < cmds.size(); ++i) {
+      auto cmd = cmds[i];
+      auto start = i ? ends[i - 1] : 0;
+      if (cmd.id == cmd_id_t::jmp || cmd.id == cmd_id_t::pop_jif)
+        cmd.val = static_cast<int64_t>(target(static_cast<int64_t>(ends[i]) + cmd.val)) - static_cast<int64_t>(i + 1);
+      else if (cmd.id == cmd_id_t::push && addresses[start])
+        cmd.val = static_cast<int64_t>(target(cmd.val));
+
+      uint32_t word = static_cast<uint8_t>(cmd.id);
+      if (cmd.val >= aligned_val_min && cmd.val <= aligned_val_max) {
+        word |= static_cast<uint32_t>(cmd.val) << aligned_val_shift;
+      } else {
+        if (aligned.pool.size() > static_cast<size_t>(aligned_val_max))
+          throw utils_n::fatal_error_t("code_n: constant pool is full");
+        word |= aligned_wide | static_cast<uint32_t>(aligned.pool.size()) << aligned_val_shift;
+        aligned.pool.push_back(cmd.val);
+      }
+      aligned.words.push_back(word);
+    }
+
+    aligned.rip = target(static_cast<int64_t>(code_ctx.rip));
+    for (const auto& label : code_ctx.labels)
+      aligned.labels.push_back({target(static_cast<int64_t>(label.offset)), label.name});
+    return aligned;
+  }
+
+
+
   std::string code_ctx_t::save() const {
     std::string str;
     code_t code_writer;
@@ -237,157 +400,402 @@ namespace aml::code_n {
 
 
 
-  bool stack_t::step(const code_t& code) {
+  void program_t::prepare(const code_ctx_t& code_ctx) {
+    prepare(code_ctx.code.buffer, code_ctx.rip);
+  }
+
+  void program_t::prepare(std::span<const uint8_t> buffer, size_t entry) {
     AML_TRACER;
-    auto cmd = code.read_cmd(rip);
-    AML_LOGGER(debug, "cmd:  {}", cmd.show());
-    AML_LOGGER(debug, "size: {}", size());
-    AML_LOGGER(debug, "rip:  {}", rip);
-    AML_LOGGER(debug, "rbp:  {}", rbp);
 
-    if (size() > 1000)
-      throw utils_n::fatal_error_t("too big stack");
+    // offset of the next cmd, jumps are relative to it
+    std::vector<size_t> ends;
 
-    switch (static_cast<cmd_id_t>(cmd.bits.id)) {
-      case cmd_id_t::arg:
-      {
-        push_back(get(size() - cmd.val));
-        break;
-      }
+    cmds.clear();
+    index.assign(buffer.size() + 1, npos);
 
-      case cmd_id_t::call:
-      {
-        size_t arg_count = back();
-        int64_t rip_new = get(size() - 1 - arg_count);
+    size_t pos = {};
+    while (pos < buffer.size()) {
+      index[pos] = cmds.size();
+      cmds.push_back(read_cmd(buffer, pos));
+      ends.push_back(pos);
+    }
 
-        push_back(rbp);
-        push_back(rip);
-        rbp = size() - 1/*rbp*/ - 1/*rip*/;
-        rip = rip_new;
-        break;
-      }
+    if (pos != buffer.size())
+      throw utils_n::fatal_error_t("program_t: truncated cmd");
 
-      case cmd_id_t::exit:
-      {
-        return false;
-      }
+    index[pos] = cmds.size();
+    resolve(ends, entry);
+  }
 
-      case cmd_id_t::jmp:
-      {
-        rip += cmd.val;
-        break;
-      }
+  void program_t::prepare_aligned(std::span<const uint8_t> words, std::span<const uint8_t> pool, size_t entry) {
+    AML_TRACER;
+    if (words.size() % sizeof(uint32_t) || pool.size() % sizeof(int64_t))
+      throw utils_n::fatal_error_t("program_t: truncated cmd");
 
-      case cmd_id_t::pop:
-      {
-        int64_t ret = back();
-        for (int64_t i{}; i < cmd.val; ++i) {
-          pop_back();
-        }
-        push_back(ret);
-        break;
+    // one word per cmd, offsets are cmd indices
+    size_t size = words.size() / sizeof(uint32_t);
+    std::vector<size_t> ends(size);
+    cmds.resize(size);
+    index.resize(size + 1);
+
+    for (size_t i{}; i < size; ++i) {
+      uint32_t word;
+      std::memcpy(&word, words.data() + i * sizeof(word), sizeof(word));
+      auto& cmd = cmds[i];
+      cmd.id  = static_cast<cmd_id_t>(word & 0xFF);
+      cmd.val = static_cast<int32_t>(word) >> aligned_val_shift;
+      if (word & aligned_wide) {
+        auto pos = static_cast<size_t>(word >> aligned_val_shift);
+        if (pos >= pool.size() / sizeof(int64_t))
+          throw utils_n::fatal_error_t("program_t: invalid pool index " + std::to_string(pos));
+        std::memcpy(&cmd.val, pool.data() + pos * sizeof(int64_t), sizeof(int64_t));
       }
+      index[i] = i;
+      ends[i] = i + 1;
+    }
 
-      case cmd_id_t::pop_jif:
-      {
-        int64_t offset = cmd.val;
-        int64_t ret = back();
-        pop_back();
+    index[size] = size;
+    resolve(ends, entry);
+  }
 
-        if (!ret) {
-          rip += offset;
+  void program_t::resolve(const std::vector<size_t>& ends, size_t entry) {
+    // falling off the end of the code stops the program
+    cmds.resize(ends.size());
+    cmds.push_back({cmd_id_t::exit});
+
+    for (size_t i{}; i < ends.size(); ++i) {
+      auto& cmd = cmds[i];
+      switch (cmd.id) {
+        case cmd_id_t::arg:
+        {
+          // arg n is addressed below the frame header, like var is above it
+          cmd.val = -(static_cast<int64_t>(frame_size) + cmd.val);
+          break;
+        }
+        case cmd_id_t::jmp:
+        case cmd_id_t::pop_jif:
+        {
+          cmd.val = static_cast<int64_t>(target(static_cast<int64_t>(ends[i]) + cmd.val));
+          break;
+        }
+        case cmd_id_t::call:
+        case cmd_id_t::exit:
+        case cmd_id_t::pop:
+        case cmd_id_t::push:
+        case cmd_id_t::ret:
+        case cmd_id_t::syscall:
+        case cmd_id_t::var:
+        case cmd_id_t::add:
+        case cmd_id_t::sub:
+        case cmd_id_t::mul:
+        case cmd_id_t::div:
+        case cmd_id_t::eq:
+        case cmd_id_t::lt:
+        case cmd_id_t::land:
+        case cmd_id_t::lor:
+        case cmd_id_t::lnot:
+        case cmd_id_t::tail_call:
+        case cmd_id_t::memo:
+        case cmd_id_t::memo_ret:
+        {
+          break;
+        }
+        default:
+        {
+          throw utils_n::fatal_error_t("program_t: unknown cmd " + std::to_string(static_cast<size_t>(cmd.id)));
         }
-        break;
       }
+    }
+
+    rip = target(static_cast<int64_t>(entry));
+    AML_LOGGER(debug, "cmds: {}", cmds.size());
+  }
+
+  size_t program_t::target(int64_t offset) const {
+    if (offset < 0 || static_cast<size_t>(offset) >= index.size() || index[offset] == npos)
+      throw utils_n::fatal_error_t("program_t: invalid offset " + std::to_string(offset));
+
+    return index[offset];
+  }
+
+  std::string program_t::show() const {
+    std::string str;
+    for (size_t i{}; i < cmds.size(); ++i) {
+      str += std::to_string(i) + "\t\t" + cmds[i].show() + "\n";
+    }
+    return str;
+  }
 
-      case cmd_id_t::push:
-      {
-        push_back(cmd.val);
-        break;
-      }
 
-      case cmd_id_t::ret:
-      {
-        int64_t ret = back();
-        pop_back();
 
-        rip = back();
-        pop_back();
+  stack_overflow_t::stack_overflow_t(size_t capacity)
+    : utils_n::fatal_error_t("stack_t: stack overflow, capacity " + std::to_string(capacity)) { }
 
-        rbp = back();
-        pop_back();
 
-        size_t arg_count = back();
-        pop_back();
 
+  stack_t::stack_t(size_t capacity, size_t heap_capacity)
+    : buffer(std::make_unique_for_overwrite<int64_t[]>(capacity)), capacity(capacity) {
+    heap.capacity = heap_capacity;
+  }
+
+
+
+  // overflows wrap around through uint64, the min int64 divided by -1 is itself instead of a trap
+  static inline int64_t op_add(int64_t a, int64_t b)  { return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b)); }
+  static inline int64_t op_sub(int64_t a, int64_t b)  { return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b)); }
+  static inline int64_t op_mul(int64_t a, int64_t b)  { return static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b)); }
+  static inline int64_t op_div(int64_t a, int64_t b)  { return !b ? 0 : b == -1 ? op_sub(0, a) : a / b; }
+  static inline int64_t op_eq(int64_t a, int64_t b)   { return a == b; }
+  static inline int64_t op_lt(int64_t a, int64_t b)   { return a < b; }
+  static inline int64_t op_land(int64_t a, int64_t b) { return a && b; }
+  static inline int64_t op_lor(int64_t a, int64_t b)  { return a || b; }
+
+  int64_t eval_native(cmd_id_t id, int64_t a, int64_t b) {
+    switch (id) {
+      case cmd_id_t::add:  return op_add(a, b);
+      case cmd_id_t::sub:  return op_sub(a, b);
+      case cmd_id_t::mul:  return op_mul(a, b);
+      case cmd_id_t::div:  return op_div(a, b);
+      case cmd_id_t::eq:   return op_eq(a, b);
+      case cmd_id_t::lt:   return op_lt(a, b);
+      case cmd_id_t::land: return op_land(a, b);
+      case cmd_id_t::lor:  return op_lor(a, b);
+      case cmd_id_t::lnot: return !a;
+      default:             throw utils_n::fatal_error_t("code_n: cmd " + std::to_string(static_cast<size_t>(id)) + " is not native");
+    }
+  }
+
+
+
+  static inline void exec_arg(stack_t& stack, const cmd_t& cmd) {
+    stack.push_back(stack.get(stack.rbp + cmd.val));
+  }
+
+  static inline void exec_call(stack_t& stack, const program_t& program) {
+    size_t arg_count = stack.back();
+    int64_t rip_new = stack.get(stack.size() - 1 - arg_count);
+
+    stack.push_back(stack.rbp);
+    stack.push_back(stack.rip);
+    stack.rbp = stack.size();
+    stack.rip = program.target(rip_new);
+  }
+
+  static inline void exec_tail_call(stack_t& stack, const program_t& program) {
+    // the new callee, its args and count replace the current frame, rbp and rip of the caller are kept
+    size_t arg_count = stack.back();
+    size_t src = stack.size() - 1 - arg_count;
+    int64_t rip_new = stack.get(src);
+
+    size_t rbp = stack.rbp;
+    size_t dst = rbp - frame_size - stack.get(rbp - frame_size);
+    int64_t rip_old = stack.get(rbp - 1/*rip*/);
+    int64_t rbp_old = stack.get(rbp - 1/*rip*/ - 1/*rbp*/);
+
+    std::copy(&stack.buffer[src], &stack.buffer[stack.size()], &stack.buffer[dst]);
+    stack.resize(dst + 1/*func*/ + arg_count);
+    stack.push_back(rbp_old);
+    stack.push_back(rip_old);
+    stack.rbp = stack.size();
+    stack.rip = program.target(rip_new);
+  }
+
+  static inline void exec_jmp(stack_t& stack, const cmd_t& cmd) {
+    stack.rip = cmd.val;
+  }
+
+  static inline void exec_pop(stack_t& stack, const cmd_t& cmd) {
+    int64_t ret = stack.back();
+    stack.resize(stack.size() - cmd.val);
+    stack.push_back(ret);
+  }
+
+  static inline void exec_pop_jif(stack_t& stack, const cmd_t& cmd) {
+    int64_t offset = cmd.val;
+    int64_t ret = stack.back();
+    stack.pop_back();
+
+    if (!ret) {
+      stack.rip = offset;
+    }
+  }
+
+  static inline void exec_push(stack_t& stack, const cmd_t& cmd) {
+    stack.push_back(cmd.val);
+  }
+
+  static inline void exec_ret(stack_t& stack) {
+    int64_t ret = stack.back();
+    size_t rbp = stack.rbp;
+    size_t arg_count = stack.get(rbp - frame_size);
+
+    stack.rip = stack.get(rbp - 1/*rip*/);
+    stack.rbp = stack.get(rbp - 1/*rip*/ - 1/*rbp*/);
+    stack.resize(rbp - frame_size - arg_count);
+    stack.push_back(ret);
+  }
+
+  static inline void exec_syscall(stack_t& stack) {
+    size_t arg_count = stack.back();
+    stack.pop_back();
+
+    int64_t ret = -1;
+    size_t op  = -1;
+    if (arg_count > 0) {
+      op = stack.back();
+      stack.pop_back();
+      arg_count--;
+
+      // a constant table, without the guarded initialization of a function-local static shared by the workers
+      static constexpr std::array<int64_t(*)(int64_t, int64_t), 8> ops2 = {
+        /*200*/ op_add,
+        /*201*/ op_sub,
+        /*202*/ op_mul,
+        /*203*/ op_div,
+        /*204*/ op_eq,
+        /*205*/ op_lt,
+        /*206*/ op_land,
+        /*207*/ op_lor,
+      };
+
+      if (arg_count == 1 && op == syscall_yield) {
+        ret = stack.back();
+        stack.pop_back();
+        arg_count--;
+        stack.yield = true;
+
+      } else if (arg_count == 1 && op == 100) {
+        int64_t opnd1 = stack.back();
+        stack.pop_back();
+        arg_count--;
+        ret = !opnd1;
+
+      } else if (arg_count == 2 && op >= 200 && op < 200 + ops2.size()) {
+        int64_t opnd1 = stack.back();
+        stack.pop_back();
+        arg_count--;
+        int64_t opnd2 = stack.back();
+        stack.pop_back();
+        arg_count--;
+
+        ret = ops2[op - 200](opnd1, opnd2);
+
+      } else if (arg_count <= array_n::args_max && static_cast<int64_t>(op) >= array_n::syscall_first
+          && static_cast<int64_t>(op) <= array_n::syscall_last) {
+        std::array<int64_t, array_n::args_max> args;
         for (size_t i{}; i < arg_count; ++i) {
-          pop_back();
+          args[i] = stack.back();
+          stack.pop_back();
         }
+        ret = stack.heap.syscall(static_cast<int64_t>(op), {args.data(), arg_count});
+        arg_count = 0;
+      }
+    }
 
-        push_back(ret);
-        break;
+    if (arg_count) {
+      for (size_t i{}; i < arg_count; ++i) {
+        stack.pop_back();
       }
+    }
 
-      case cmd_id_t::syscall:
-      {
-        size_t arg_count = back();
-        pop_back();
-
-        int64_t ret = -1;
-        size_t op  = -1;
-        if (arg_count > 0) {
-          op = back();
-          pop_back();
-          arg_count--;
-
-          static std::vector<std::function<int64_t(int64_t, int64_t)>> ops2 = {
-            /*200*/ [](int64_t a, int64_t b) { return a + b; },
-            /*201*/ [](int64_t a, int64_t b) { return a - b; },
-            /*202*/ [](int64_t a, int64_t b) { return a * b; },
-            /*203*/ [](int64_t a, int64_t b) { return !b ? 0 : a / b; },
-            /*204*/ [](int64_t a, int64_t b) { return a == b; },
-            /*205*/ [](int64_t a, int64_t b) { return a < b; },
-            /*206*/ [](int64_t a, int64_t b) { return a && b; },
-            /*207*/ [](int64_t a, int64_t b) { return a || b; },
-          };
-
-          if (arg_count == 1 && op == 100) {
-            int64_t opnd1 = back();
-            pop_back();
-            arg_count--;
-            ret = !opnd1;
-
-          } else if (arg_count == 2 && op >= 200 && op < 200 + ops2.size()) {
-            int64_t opnd1 = back();
-            pop_back();
-            arg_count--;
-            int64_t opnd2 = back();
-            pop_back();
-            arg_count--;
-
-            ret = ops2[op - 200](opnd1, opnd2);
-          }
-        }
+    stack.push_back(ret);
+  }
 
-        if (arg_count) {
-          for (size_t i{}; i < arg_count; ++i) {
-            pop_back();
-          }
-        }
+  static inline void exec_var(stack_t& stack, const cmd_t& cmd) {
+    stack.push_back(stack.get(stack.rbp + cmd.val));
+  }
+
+  template <typename F>
+  static inline void exec_binary(stack_t& stack, F f) {
+    int64_t a = stack.back();
+    stack.pop_back();
+    int64_t& b = stack.back();
+    b = f(a, b);
+  }
+
+  static inline void exec_lnot(stack_t& stack) {
+    int64_t& a = stack.back();
+    a = !a;
+  }
+
+  static inline memo_t::entry_t* memo_entry(stack_t& stack, int64_t operand, size_t& count) {
+    // the count of a frame includes the func, args out of the key or below the arity of the defn are not cached
+    count = stack.get(stack.rbp - frame_size) - 1;
+    if (count > memo_t::args_max || static_cast<int64_t>(count) < (operand & ((1 << memo_t::arity_bits) - 1)))
+      return nullptr;
+
+    auto& memo = stack.memo;
+    if (memo.entries.empty())
+      memo.entries.resize(std::bit_ceil(std::max<size_t>(memo.capacity, 2)));
+
+    // fibonacci hashing, the high bits of the product select the entry
+    uint64_t hash = static_cast<uint64_t>(operand);
+    for (size_t i{}; i < count; ++i)
+      hash = (hash ^ static_cast<uint64_t>(stack.buffer[stack.rbp - frame_size - 1 - i])) * 0x9E3779B97F4A7C15ull;
+    return &memo.entries[hash >> (64 - std::countr_zero(memo.entries.size()))];
+  }
+
+  static inline void exec_memo(stack_t& stack, const cmd_t& cmd) {
+    size_t count;
+    auto entry = memo_entry(stack, cmd.val, count);
+    auto& memo = stack.memo;
+    memo.hit = entry
+      && entry->generation == memo.generation
+      && entry->func == cmd.val
+      && entry->count == count
+      && std::equal(entry->args, entry->args + count,
+          std::make_reverse_iterator(&stack.buffer[stack.rbp - frame_size]));
+    if (!memo.hit) {
+      memo.misses++;
+      return;
+    }
+
+    memo.hits++;
+    stack.push_back(entry->value);
+    exec_ret(stack);
+  }
+
+  static inline void exec_memo_ret(stack_t& stack, const cmd_t& cmd) {
+    size_t count;
+    if (auto entry = memo_entry(stack, cmd.val, count)) {
+      entry->generation = stack.memo.generation;
+      entry->func       = cmd.val;
+      entry->count      = count;
+      entry->value      = stack.back();
+      std::copy_n(std::make_reverse_iterator(&stack.buffer[stack.rbp - frame_size]), count, entry->args);
+    }
+    exec_ret(stack);
+  }
 
-        push_back(ret);
-        break;
-      }
 
-      case cmd_id_t::var:
-      {
-        push_back(get(rbp + 1/*rbp*/ + 1/*rip*/ + cmd.val));
-        break;
-      }
 
+  static inline bool exec(stack_t& stack, const program_t& program, const cmd_t& cmd) {
+    switch (cmd.id) {
+      case cmd_id_t::arg:       exec_arg(stack, cmd);           break;
+      case cmd_id_t::call:      exec_call(stack, program);      break;
+      case cmd_id_t::exit:      return false;
+      case cmd_id_t::jmp:       exec_jmp(stack, cmd);           break;
+      case cmd_id_t::pop:       exec_pop(stack, cmd);           break;
+      case cmd_id_t::pop_jif:   exec_pop_jif(stack, cmd);       break;
+      case cmd_id_t::push:      exec_push(stack, cmd);          break;
+      case cmd_id_t::ret:       exec_ret(stack);                break;
+      case cmd_id_t::syscall:   exec_syscall(stack);            break;
+      case cmd_id_t::var:       exec_var(stack, cmd);           break;
+      case cmd_id_t::add:       exec_binary(stack, op_add);     break;
+      case cmd_id_t::sub:       exec_binary(stack, op_sub);     break;
+      case cmd_id_t::mul:       exec_binary(stack, op_mul);     break;
+      case cmd_id_t::div:       exec_binary(stack, op_div);     break;
+      case cmd_id_t::eq:        exec_binary(stack, op_eq);      break;
+      case cmd_id_t::lt:        exec_binary(stack, op_lt);      break;
+      case cmd_id_t::land:      exec_binary(stack, op_land);    break;
+      case cmd_id_t::lor:       exec_binary(stack, op_lor);     break;
+      case cmd_id_t::lnot:      exec_lnot(stack);               break;
+      case cmd_id_t::tail_call: exec_tail_call(stack, program); break;
+      case cmd_id_t::memo:      exec_memo(stack, cmd);          break;
+      case cmd_id_t::memo_ret:  exec_memo_ret(stack, cmd);      break;
       default:
       {
-        AML_LOGGER(err, "unknown cmd: {} {}", static_cast<uint8_t>(cmd.bits.id), cmd.show());
+        AML_LOGGER(err, "unknown cmd: {} {}", static_cast<uint8_t>(cmd.id), cmd.show());
         break;
       }
     }
@@ -395,42 +803,130 @@ namespace aml::code_n {
     return true;
   }
 
-  size_t stack_t::size() const {
-    return buffer.size();
-  }
 
-  int64_t& stack_t::get(size_t pos) {
-    static int64_t fake_value = {};
-    if (buffer.empty())
-      return fake_value;
 
-    return buffer[pos % buffer.size()];
-  }
+  bool stack_t::step(const program_t& program) {
+    AML_TRACER;
+    const auto& cmd = program.cmds[rip++];
+    AML_LOGGER(debug, "cmd:  {}", cmd.show());
+    AML_LOGGER(debug, "size: {}", size());
+    AML_LOGGER(debug, "rip:  {}", rip);
+    AML_LOGGER(debug, "rbp:  {}", rbp);
 
-  int64_t& stack_t::back() {
-    return get(buffer.size() - 1);
+    return exec(*this, program, cmd);
   }
 
-  void stack_t::push_back(int64_t value) {
-    if (buffer.size() >= limit)
-      buffer.pop_front();
+  bool stack_t::run(const program_t& program, size_t& budget, profile_n::profile_t& profile) {
+    AML_TRACER;
+    // a separate loop, the threaded dispatch of run without a profile stays uninstrumented
+    heap.pay(budget);
+    while (budget) {
+      --budget;
+      const auto& cmd = program.cmds[rip++];
+      profile.count(cmd.id);
+      if (!exec(*this, program, cmd)) {
+        profile.finish();
+        return true;
+      }
+      heap.pay(budget);
+      profile.after(cmd.id, *this);
+    }
 
-    buffer.push_back(value);
+    profile.finish();
+    return false;
   }
 
-  void stack_t::pop_back() {
-    if (!buffer.empty())
-      buffer.pop_back();
+  bool stack_t::run(const program_t& program, size_t& budget) {
+    AML_TRACER;
+    // the budget is counted in a local and written back when run returns
+    const cmd_t* cmd = nullptr;
+    size_t fuel = budget;
+    yield = false;
+    heap.pay(fuel);
+
+#define AML_FETCH()                                         \
+    if (!fuel) {                                            \
+      budget = 0;                                           \
+      return false;                                         \
+    }                                                       \
+    fuel--;                                                 \
+    cmd = &program.cmds[rip++];
+
+#if defined(__GNUC__)
+    // direct threaded dispatch: every handler jumps straight to the next one
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static const void* labels[cmd_id_count] = {
+      &&label_arg,     &&label_call,    &&label_exit,    &&label_jmp,
+      &&label_pop,     &&label_pop_jif, &&label_push,    &&label_ret,
+      &&label_syscall, &&label_var,     &&label_unknown, &&label_unknown,
+      &&label_unknown, &&label_unknown, &&label_unknown, &&label_unknown,
+      &&label_add,     &&label_sub,     &&label_mul,     &&label_div,
+      &&label_eq,      &&label_lt,      &&label_land,    &&label_lor,
+      &&label_lnot,    &&label_tail_call, &&label_memo, &&label_memo_ret,
+    };
+#define AML_OP(name) label_##name:
+#define AML_NEXT() AML_FETCH(); goto *labels[static_cast<size_t>(cmd->id)];
+
+    AML_NEXT();
+#else
+#define AML_OP(name) case cmd_id_t::name:
+#define AML_NEXT() continue;
+
+    for (;;) {
+      AML_FETCH();
+      switch (cmd->id) {
+#endif
+
+    AML_OP(arg)       exec_arg(*this, *cmd);          AML_NEXT();
+    AML_OP(call)      exec_call(*this, program);      AML_NEXT();
+    AML_OP(exit)      budget = fuel; return true;
+    AML_OP(jmp)       exec_jmp(*this, *cmd);          AML_NEXT();
+    AML_OP(pop)       exec_pop(*this, *cmd);          AML_NEXT();
+    AML_OP(pop_jif)   exec_pop_jif(*this, *cmd);      AML_NEXT();
+    AML_OP(push)      exec_push(*this, *cmd);         AML_NEXT();
+    AML_OP(ret)       exec_ret(*this);                AML_NEXT();
+    AML_OP(syscall)   exec_syscall(*this);            heap.pay(fuel); if (yield) { budget = fuel; return false; } AML_NEXT();
+    AML_OP(var)       exec_var(*this, *cmd);          AML_NEXT();
+    AML_OP(add)       exec_binary(*this, op_add);     AML_NEXT();
+    AML_OP(sub)       exec_binary(*this, op_sub);     AML_NEXT();
+    AML_OP(mul)       exec_binary(*this, op_mul);     AML_NEXT();
+    AML_OP(div)       exec_binary(*this, op_div);     AML_NEXT();
+    AML_OP(eq)        exec_binary(*this, op_eq);      AML_NEXT();
+    AML_OP(lt)        exec_binary(*this, op_lt);      AML_NEXT();
+    AML_OP(land)      exec_binary(*this, op_land);    AML_NEXT();
+    AML_OP(lor)       exec_binary(*this, op_lor);     AML_NEXT();
+    AML_OP(lnot)      exec_lnot(*this);               AML_NEXT();
+    AML_OP(tail_call) exec_tail_call(*this, program); AML_NEXT();
+    AML_OP(memo)      exec_memo(*this, *cmd);         AML_NEXT();
+    AML_OP(memo_ret)  exec_memo_ret(*this, *cmd);     AML_NEXT();
+
+#if defined(__GNUC__)
+    label_unknown:
+    AML_LOGGER(err, "unknown cmd: {} {}", static_cast<uint8_t>(cmd->id), cmd->show());
+    AML_NEXT();
+#pragma GCC diagnostic pop
+#else
+        default:
+        AML_LOGGER(err, "unknown cmd: {} {}", static_cast<uint8_t>(cmd->id), cmd->show());
+        AML_NEXT();
+      }
+    }
+#endif
+
+#undef AML_NEXT
+#undef AML_OP
+#undef AML_FETCH
   }
 
   std::string stack_t::show() const {
     std::string str;
-    str += "size: " + std::to_string(buffer.size()) + "\t";
+    str += "size: " + std::to_string(top) + "\t";
     str += "rbp: " + std::to_string(rbp) + "\t";
     str += "rip: " + std::to_string(rip) + "\t";
     str += "stack: ";
-    for (const auto& v : buffer) {
-      str += std::to_string(v) + " ";
+    for (size_t i{}; i < top; ++i) {
+      str += std::to_string(buffer[i]) + " ";
     }
     return str;
   }
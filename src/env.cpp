@@ -9,19 +9,48 @@ namespace aml::env_n {
 
 
 
+  var_info_sptr_t table_t::def(const token_n::symbol_t& key, size_t scope) {
+    auto shadow = head(key);
+    if (shadow != npos && bindings[shadow].scope == scope)
+      throw utils_n::fatal_error_t("env_t: '" + std::string(key.name) + "' is exists");
+
+    auto var    = std::make_shared<var_info_t>();
+    var->id     = env_t::id++;
+    var->symbol = key;
+    var->name   = key.name;
+
+    if (key.id >= heads.size())
+      heads.resize(key.id + 1, npos);
+    heads[key.id] = bindings.size();
+    bindings.push_back({var, shadow, scope});
+    return var;
+  }
+
+  var_info_sptr_t table_t::get(const token_n::symbol_t& key) const {
+    auto pos = head(key);
+    if (pos == npos)
+      throw utils_n::fatal_error_t("env_t: '" + std::string(key.name) + "' is not exists");
+    return bindings[pos].var;
+  }
+
+  void table_t::unwind(size_t size) {
+    while (bindings.size() > size) {
+      heads[bindings.back().var->symbol.id] = bindings.back().shadow;
+      bindings.pop_back();
+    }
+  }
+
+
+
   std::string env_t::show() const {
     std::string str;
-    auto env = this->shared_from_this();
-    size_t deep = {};
-    while (env) {
-      for (const auto& func : env->funcs) {
-        str += std::to_string(deep) + " func: " + utils_n::indent(deep) + func->show() + "\n";
-      }
-      for (const auto& var : env->vars) {
-        str += std::to_string(deep) + " var:  " + utils_n::indent(deep) + var->show() + "\n";
-      }
-      env = env->parent;
-      deep++;
+    for (const auto& binding : funcs.bindings) {
+      auto deep = binding.scope;
+      str += std::to_string(deep) + " func: " + utils_n::indent(deep) + binding.var->show() + "\n";
+    }
+    for (const auto& binding : vars.bindings) {
+      auto deep = binding.scope;
+      str += std::to_string(deep) + " var:  " + utils_n::indent(deep) + binding.var->show() + "\n";
     }
     return str;
   }
@@ -0,0 +1,223 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "logger.h"
+
+namespace aml::image_n {
+
+  static void write_u32(std::string& str, uint32_t data) {
+    for (size_t i{}; i < sizeof(data); ++i, data >>= 8)
+      str.push_back(static_cast<char>(data & 0xFF));
+  }
+
+  static void write_u64(std::string& str, uint64_t data) {
+    for (size_t i{}; i < sizeof(data); ++i, data >>= 8)
+      str.push_back(static_cast<char>(data & 0xFF));
+  }
+
+  static uint64_t read_u64(std::span<const uint8_t> data, size_t pos, size_t size = sizeof(uint64_t)) {
+    if (pos > data.size() || size > data.size() - pos)
+      throw utils_n::fatal_error_t("image_t: truncated image");
+    uint64_t value = {};
+    for (size_t i{}; i < size; ++i)
+      value |= static_cast<uint64_t>(data[pos + i]) << (8 * i);
+    return value;
+  }
+
+
+
+  std::string save(const code_n::code_ctx_t& code_ctx, code_n::encoding_t encoding) {
+    AML_TRACER;
+    auto aligned = encoding == code_n::encoding_t::aligned
+      ? code_n::align(code_ctx)
+      : code_n::aligned_code_t{};
+
+    std::string code;
+    std::string pool;
+    size_t rip = code_ctx.rip;
+    auto labels = code_ctx.labels;
+    if (encoding == code_n::encoding_t::aligned) {
+      for (auto word : aligned.words)
+        write_u32(code, word);
+      for (auto value : aligned.pool)
+        write_u64(pool, static_cast<uint64_t>(value));
+      rip = aligned.rip;
+      labels = aligned.labels;
+    } else {
+      code.assign(code_ctx.code.buffer.begin(), code_ctx.code.buffer.end());
+    }
+
+    std::string entry;
+    write_u64(entry, rip);
+    write_u64(entry, code_ctx.rsp);
+
+    std::string symbols;
+    write_u64(symbols, labels.size());
+    for (const auto& label : labels) {
+      write_u64(symbols, label.offset);
+      write_u64(symbols, label.name.size());
+      symbols += label.name;
+    }
+
+    std::vector<std::pair<section_id_t, std::string_view>> sections = {
+      {section_id_t::code,    code},
+      {section_id_t::entry,   entry},
+      {section_id_t::symbols, symbols},
+    };
+    if (encoding == code_n::encoding_t::aligned)
+      sections.push_back({section_id_t::pool, pool});
+
+    std::string str = magic;
+    write_u32(str, version);
+    write_u32(str, static_cast<uint32_t>(sections.size()));
+    write_u32(str, static_cast<uint32_t>(encoding));
+
+    // sections start at 8 byte boundaries, so words and pool values are aligned in the mapping
+    auto padded = [](size_t size) { return (size + 7) & ~size_t{7}; };
+    size_t offset = header_size + sections.size() * section_size;
+    for (const auto& [id, data] : sections) {
+      write_u32(str, static_cast<uint32_t>(id));
+      write_u32(str, {});
+      write_u64(str, offset);
+      write_u64(str, data.size());
+      offset += padded(data.size());
+    }
+    for (const auto& [id, data] : sections) {
+      str += data;
+      str.append(padded(data.size()) - data.size(), '\0');
+    }
+    return str;
+  }
+
+
+
+  image_t::~image_t() {
+    if (mapping)
+      munmap(mapping, data.size());
+  }
+
+  std::unique_ptr<image_t> image_t::map(const std::string& filename) {
+    AML_TRACER;
+    auto image = std::make_unique<image_t>();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw utils_n::fatal_error_t("image_t: can not open '" + filename + "'");
+
+    struct stat st = {};
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+      close(fd);
+      throw utils_n::fatal_error_t("image_t: can not read '" + filename + "'");
+    }
+
+    auto size = static_cast<size_t>(st.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+      throw utils_n::fatal_error_t("image_t: can not map '" + filename + "'");
+
+    image->mapping = mapping;
+    image->data = {static_cast<const uint8_t*>(mapping), size};
+    AML_LOGGER(debug, "mapped: {} {} bytes", filename, size);
+    return image;
+  }
+
+  std::unique_ptr<image_t> image_t::view(std::string_view str) {
+    auto image = std::make_unique<image_t>();
+    image->data = {reinterpret_cast<const uint8_t*>(str.data()), str.size()};
+    return image;
+  }
+
+
+
+  bool image_t::legacy() const {
+    return data.size() < magic.size()
+      || std::memcmp(data.data(), magic.data(), magic.size()) != 0;
+  }
+
+  code_n::encoding_t image_t::encoding() const {
+    if (legacy())
+      return code_n::encoding_t::packed;
+
+    auto encoding = read_u64(data, magic.size() + 2 * sizeof(uint32_t), sizeof(uint32_t));
+    if (encoding > static_cast<uint32_t>(code_n::encoding_t::aligned))
+      throw utils_n::fatal_error_t("image_t: unknown encoding " + std::to_string(encoding));
+    return static_cast<code_n::encoding_t>(encoding);
+  }
+
+  void image_t::prepare(code_n::program_t& program) const {
+    switch (encoding()) {
+      case code_n::encoding_t::packed:  program.prepare(code(), entry());                                  break;
+      case code_n::encoding_t::aligned: program.prepare_aligned(code(), section(section_id_t::pool), entry()); break;
+    }
+  }
+
+  std::span<const uint8_t> image_t::section(section_id_t id) const {
+    if (legacy())
+      throw utils_n::fatal_error_t("image_t: legacy image has no sections");
+
+    auto version_image = read_u64(data, magic.size(), sizeof(uint32_t));
+    if (version_image > version)
+      throw utils_n::fatal_error_t("image_t: unsupported version " + std::to_string(version_image));
+
+    auto count = read_u64(data, magic.size() + sizeof(uint32_t), sizeof(uint32_t));
+    for (size_t i{}; i < count; ++i) {
+      size_t pos = header_size + i * section_size;
+      if (read_u64(data, pos, sizeof(uint32_t)) != static_cast<uint32_t>(id))
+        continue;
+
+      auto offset = read_u64(data, pos + 2 * sizeof(uint32_t));
+      auto size   = read_u64(data, pos + 2 * sizeof(uint32_t) + sizeof(uint64_t));
+      if (offset > data.size() || size > data.size() - offset)
+        throw utils_n::fatal_error_t("image_t: section " + std::to_string(static_cast<uint32_t>(id)) + " is out of the image");
+      return data.subspan(offset, size);
+    }
+    return {};
+  }
+
+  std::span<const uint8_t> image_t::code() const {
+    if (legacy()) {
+      if (data.size() < 2 * sizeof(uint64_t))
+        throw utils_n::fatal_error_t("image_t: truncated image");
+      return data.subspan(2 * sizeof(uint64_t));
+    }
+    return section(section_id_t::code);
+  }
+
+  size_t image_t::entry() const {
+    if (legacy())
+      return read_u64(data, {});
+
+    auto section_entry = section(section_id_t::entry);
+    if (section_entry.empty())
+      throw utils_n::fatal_error_t("image_t: no entry section");
+    return read_u64(section_entry, {});
+  }
+
+  std::vector<code_n::label_t> image_t::labels() const {
+    std::vector<code_n::label_t> labels;
+    auto symbols = legacy() ? std::span<const uint8_t>{} : section(section_id_t::symbols);
+    if (symbols.empty())
+      return labels;
+
+    size_t pos = {};
+    auto count = read_u64(symbols, pos);
+    pos += sizeof(uint64_t);
+    for (size_t i{}; i < count; ++i) {
+      auto offset = read_u64(symbols, pos);
+      auto size   = read_u64(symbols, pos + sizeof(uint64_t));
+      pos += 2 * sizeof(uint64_t);
+      if (size > symbols.size() - pos)
+        throw utils_n::fatal_error_t("image_t: truncated symbols");
+      labels.push_back({offset, {reinterpret_cast<const char*>(symbols.data() + pos), size}});
+      pos += size;
+    }
+    return labels;
+  }
+}
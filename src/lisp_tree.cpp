@@ -1,5 +1,7 @@
 #include "lisp_tree.h"
 
+#include <stack>
+
 namespace aml::lisp_tree_n {
   namespace utils_n = aml::utils_n;
 
@@ -46,7 +48,7 @@ namespace aml::lisp_tree_n {
 
       } else if (token.type == token_n::type_t::rp) {
         if (stack.size() < 2)
-          throw utils_n::fatal_error_t("lisp_tree: unexpected ')' at " + token.pos.show() + " " + token.lexeme);
+          throw utils_n::fatal_error_t("lisp_tree: unexpected ')' at " + token.pos.show() + " " + std::string(token.lexeme));
         auto top = stack.top();
         stack.pop();
         stack.top().nodes.push_back(top);
@@ -60,7 +62,7 @@ namespace aml::lisp_tree_n {
     }
 
     if (stack.size() != 1)
-      throw utils_n::fatal_error_t("lisp_tree: parse error at " + token_last.pos.show() + " " + token_last.lexeme);
+      throw utils_n::fatal_error_t("lisp_tree: parse error at " + token_last.pos.show() + " " + std::string(token_last.lexeme));
 
     return stack.top();
   }
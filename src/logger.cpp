@@ -7,8 +7,9 @@ namespace aml::logger_n {
 
   logger_t::logger_t(const char* file, int line, const char* function)
     : file(file), line(line), function(function) {
-      logger->log(spdlog::source_loc{file, line, function}, spdlog::level::trace,
-          "{}{}", utils_n::indent(indent), function);
+      if (logger->should_log(spdlog::level::trace))
+        logger->log(spdlog::source_loc{file, line, function}, spdlog::level::trace,
+            "{}{}", utils_n::indent(indent), function);
 
       if (level <= spdlog::level::trace)
         indent++;
@@ -18,8 +19,9 @@ namespace aml::logger_n {
     if (level <= spdlog::level::trace)
       indent--;
 
-    logger->log(spdlog::source_loc{file, line, function}, spdlog::level::trace,
-        "{}{}~", utils_n::indent(indent), function);
+    if (logger->should_log(spdlog::level::trace))
+      logger->log(spdlog::source_loc{file, line, function}, spdlog::level::trace,
+          "{}{}~", utils_n::indent(indent), function);
   }
 
   void logger_t::init(const std::string& file_log, const std::string& level_str) {
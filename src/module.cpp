@@ -0,0 +1,324 @@
+#include "module.h"
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <thread>
+
+#include "logger.h"
+
+namespace aml::module_n {
+
+  uint64_t hash(std::string_view data) {
+    // FNV-1a
+    uint64_t value = 0xcbf29ce484222325;
+    for (auto c : data) {
+      value ^= static_cast<uint8_t>(c);
+      value *= 0x100000001b3;
+    }
+    return value;
+  }
+
+  std::string path(const std::string& dir, std::string_view code) {
+    static const char* digits = "0123456789abcdef";
+    auto value = hash(code);
+    std::string name(16, '0');
+    for (size_t i{}; i < name.size(); ++i, value >>= 4)
+      name[name.size() - i - 1] = digits[value & 0x0F];
+    return (std::filesystem::path(dir) / (name + ".amlm")).string();
+  }
+
+
+
+  void writer_t::write_u8(uint8_t data) {
+    buffer.push_back(static_cast<char>(data));
+  }
+
+  void writer_t::write_u64(uint64_t data) {
+    for (size_t i{}; i < sizeof(data); ++i, data >>= 8)
+      write_u8(static_cast<uint8_t>(data));
+  }
+
+  void writer_t::write_str(std::string_view data) {
+    write_u64(data.size());
+    buffer.append(data);
+  }
+
+  void writer_t::write_stmt(const stmt_n::stmt_t* stmt) {
+    write_u8(static_cast<uint8_t>(stmt->type()));
+    switch (stmt->type()) {
+      case stmt_n::type_t::stmt_arg:
+      {
+        write_u64(static_cast<uint64_t>(static_cast<const stmt_n::stmt_arg_t*>(stmt)->value));
+        break;
+      }
+      case stmt_n::type_t::stmt_block:
+      {
+        auto stmt_block = static_cast<const stmt_n::stmt_block_t*>(stmt);
+        write_u64(stmt_block->args.size());
+        for (auto arg : stmt_block->args)
+          write_stmt(arg);
+        break;
+      }
+      case stmt_n::type_t::stmt_call:
+      {
+        auto stmt_call = static_cast<const stmt_n::stmt_call_t*>(stmt);
+        write_stmt(stmt_call->name);
+        write_u64(stmt_call->args.size());
+        for (auto arg : stmt_call->args)
+          write_stmt(arg);
+        break;
+      }
+      case stmt_n::type_t::stmt_defn:
+      {
+        auto stmt_defn = static_cast<const stmt_n::stmt_defn_t*>(stmt);
+        write_str(stmt_defn->var->name);
+        write_stmt(stmt_defn->body);
+        break;
+      }
+      case stmt_n::type_t::stmt_defvar:
+      {
+        auto stmt_defvar = static_cast<const stmt_n::stmt_defvar_t*>(stmt);
+        write_str(stmt_defvar->var->name);
+        write_stmt(stmt_defvar->body);
+        break;
+      }
+      case stmt_n::type_t::stmt_func:
+      {
+        write_str(static_cast<const stmt_n::stmt_func_t*>(stmt)->var->name);
+        break;
+      }
+      case stmt_n::type_t::stmt_if:
+      {
+        auto stmt_if = static_cast<const stmt_n::stmt_if_t*>(stmt);
+        write_stmt(stmt_if->expr_if);
+        write_stmt(stmt_if->expr_then);
+        write_stmt(stmt_if->expr_else);
+        break;
+      }
+      case stmt_n::type_t::stmt_include:
+      {
+        write_str(static_cast<const stmt_n::stmt_include_t*>(stmt)->filename);
+        break;
+      }
+      case stmt_n::type_t::stmt_int:
+      {
+        write_u64(static_cast<uint64_t>(static_cast<const stmt_n::stmt_int_t*>(stmt)->value));
+        break;
+      }
+      case stmt_n::type_t::stmt_syscall:
+      {
+        auto stmt_syscall = static_cast<const stmt_n::stmt_syscall_t*>(stmt);
+        write_u64(stmt_syscall->args.size());
+        for (auto arg : stmt_syscall->args)
+          write_stmt(arg);
+        break;
+      }
+      case stmt_n::type_t::stmt_var:
+      {
+        write_str(static_cast<const stmt_n::stmt_var_t*>(stmt)->var->name);
+        break;
+      }
+      default:
+      {
+        throw utils_n::fatal_error_t("module_n: can not save type_t " + std::to_string(static_cast<size_t>(stmt->type())));
+      }
+    }
+  }
+
+
+
+  uint8_t reader_t::read_u8() {
+    if (pos >= buffer.size())
+      throw utils_n::fatal_error_t("module_n: unexpected end of module");
+    return static_cast<uint8_t>(buffer[pos++]);
+  }
+
+  uint64_t reader_t::read_u64() {
+    uint64_t data = {};
+    for (size_t i{}; i < sizeof(data); ++i)
+      data |= static_cast<uint64_t>(read_u8()) << (8 * i);
+    return data;
+  }
+
+  std::string_view reader_t::read_str() {
+    auto size = read_u64();
+    if (size > buffer.size() - pos)
+      throw utils_n::fatal_error_t("module_n: unexpected end of module");
+    auto data = buffer.substr(pos, size);
+    pos += size;
+    return data;
+  }
+
+  token_n::symbol_t reader_t::read_symbol() {
+    return options.symbols->intern(read_str());
+  }
+
+  stmt_n::stmts_t reader_t::read_stmts() {
+    auto size = read_u64();
+    if (size > buffer.size() - pos)
+      throw utils_n::fatal_error_t("module_n: unexpected end of module");
+    auto stmts = options.arena->array<stmt_n::stmt_t*>(size);
+    for (auto& stmt : stmts)
+      stmt = read_stmt();
+    return stmts;
+  }
+
+  stmt_n::stmt_t* reader_t::read_stmt() {
+    // the env is updated in the same order as stmt_t::parse does it
+    auto type = static_cast<stmt_n::type_t>(read_u8());
+    auto stmt = stmt_n::stmt_t::factory(type, *options.arena);
+    switch (type) {
+      case stmt_n::type_t::stmt_arg:
+      {
+        static_cast<stmt_n::stmt_arg_t*>(stmt)->value = static_cast<int64_t>(read_u64());
+        break;
+      }
+      case stmt_n::type_t::stmt_block:
+      {
+        env_n::scope_t scope(*env);
+        static_cast<stmt_n::stmt_block_t*>(stmt)->args = read_stmts();
+        break;
+      }
+      case stmt_n::type_t::stmt_call:
+      {
+        auto stmt_call = static_cast<stmt_n::stmt_call_t*>(stmt);
+        stmt_call->name = read_stmt();
+        stmt_call->args = read_stmts();
+        break;
+      }
+      case stmt_n::type_t::stmt_defn:
+      {
+        auto stmt_defn = static_cast<stmt_n::stmt_defn_t*>(stmt);
+        stmt_defn->var = env->def_func(read_symbol());
+        env_n::scope_t scope(*env);
+        stmt_defn->body = read_stmt();
+        stmt_defn->var->native = stmt_n::stmt_t::native(stmt_defn->body);
+        stmt_n::stmt_t::mark_tail(stmt_defn->body);
+        break;
+      }
+      case stmt_n::type_t::stmt_defvar:
+      {
+        auto stmt_defvar = static_cast<stmt_n::stmt_defvar_t*>(stmt);
+        stmt_defvar->var  = env->def_var(read_symbol());
+        stmt_defvar->body = read_stmt();
+        break;
+      }
+      case stmt_n::type_t::stmt_func:
+      {
+        static_cast<stmt_n::stmt_func_t*>(stmt)->var = env->get_func(read_symbol());
+        break;
+      }
+      case stmt_n::type_t::stmt_if:
+      {
+        auto stmt_if = static_cast<stmt_n::stmt_if_t*>(stmt);
+        stmt_if->expr_if   = read_stmt();
+        stmt_if->expr_then = read_stmt();
+        stmt_if->expr_else = read_stmt();
+        break;
+      }
+      case stmt_n::type_t::stmt_include:
+      {
+        auto stmt_include = static_cast<stmt_n::stmt_include_t*>(stmt);
+        stmt_include->filename = read_str();
+        stmt_include->body = stmt_n::stmt_include_t::include(env, options, stmt_include->filename);
+        break;
+      }
+      case stmt_n::type_t::stmt_int:
+      {
+        static_cast<stmt_n::stmt_int_t*>(stmt)->value = static_cast<int64_t>(read_u64());
+        break;
+      }
+      case stmt_n::type_t::stmt_syscall:
+      {
+        static_cast<stmt_n::stmt_syscall_t*>(stmt)->args = read_stmts();
+        break;
+      }
+      case stmt_n::type_t::stmt_var:
+      {
+        static_cast<stmt_n::stmt_var_t*>(stmt)->var = env->get_var(read_symbol());
+        break;
+      }
+      default:
+      {
+        throw utils_n::fatal_error_t("module_n: can not load type_t " + std::to_string(static_cast<size_t>(type)));
+      }
+    }
+    return stmt;
+  }
+
+
+
+  stmt_n::stmt_t* load(env_n::env_sptr_t env, stmt_n::options_t& options, std::string_view code) {
+    AML_TRACER;
+    auto filename = path(options.module_cache, code);
+    std::string data = utils_n::str_from_file(filename);
+    if (data.empty())
+      return nullptr;
+
+    // header: magic, version, hash of the code, hash of the payload
+    auto header = magic.size() + 1 + 2 * sizeof(uint64_t);
+    if (data.size() < header || data.compare(0, magic.size(), magic) != 0)
+      return nullptr;
+
+    reader_t reader{.buffer = data, .pos = magic.size(), .env = env, .options = options};
+    if (reader.read_u8() != version
+        || reader.read_u64() != hash(code)
+        || reader.read_u64() != hash(reader.buffer.substr(header))) {
+      AML_LOGGER(debug, "module {} is stale", filename);
+      return nullptr;
+    }
+    AML_LOGGER(debug, "module {} is loaded for {}", filename, options.filename);
+
+    auto program  = static_cast<stmt_n::stmt_program_t*>(stmt_n::stmt_t::factory(stmt_n::type_t::stmt_program, *options.arena));
+    program->body = stmt_n::stmt_t::factory(stmt_n::type_t::stmt_stub, *options.arena);
+
+    std::vector<stmt_n::stmt_t*> funcs_all;
+    program->items = reader.read_stmts();
+    for (auto stmt : program->items) {
+      if (auto stmt_include = dynamic_cast<stmt_n::stmt_include_t*>(stmt)) {
+        if (auto stmt_program = dynamic_cast<stmt_n::stmt_program_t*>(stmt_include->body))
+          funcs_all.insert(funcs_all.end(), stmt_program->funcs.begin(), stmt_program->funcs.end());
+      } else {
+        funcs_all.push_back(stmt);
+      }
+    }
+    program->funcs = options.arena->array<stmt_n::stmt_t*>(funcs_all);
+    return program;
+  }
+
+  void save(const stmt_n::stmt_program_t* program, const stmt_n::options_t& options, std::string_view code) {
+    AML_TRACER;
+    // the call of an included program is never executed, so only includes and defns are kept
+    std::vector<const stmt_n::stmt_t*> items;
+    for (auto stmt : program->items) {
+      if (stmt->type() == stmt_n::type_t::stmt_include || stmt->type() == stmt_n::type_t::stmt_defn)
+        items.push_back(stmt);
+    }
+
+    writer_t payload;
+    payload.write_u64(items.size());
+    for (auto stmt : items)
+      payload.write_stmt(stmt);
+
+    writer_t writer;
+    writer.buffer = magic;
+    writer.write_u8(version);
+    writer.write_u64(hash(code));
+    writer.write_u64(hash(payload.buffer));
+    writer.buffer += payload.buffer;
+
+    // written aside and renamed, concurrent compilations never see a partial module
+    auto filename = path(options.module_cache, code);
+    auto filename_tmp = filename + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()))
+      + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    try {
+      std::filesystem::create_directories(options.module_cache);
+      utils_n::str_to_file(writer.buffer, filename_tmp);
+      std::filesystem::rename(filename_tmp, filename);
+      AML_LOGGER(debug, "module {} is saved for {}", filename, options.filename);
+    } catch (const std::exception& ex) {
+      AML_LOGGER(warn, "module {} is not saved: {}", filename, ex.what());
+    }
+  }
+}
@@ -0,0 +1,533 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+#include "logger.h"
+
+namespace aml::optimizer_n {
+
+  slots_t children(stmt_ptr_t stmt) {
+    slots_t slots;
+    switch (stmt->type()) {
+      case stmt_n::type_t::stmt_block:
+      {
+        for (auto& arg : static_cast<stmt_n::stmt_block_t*>(stmt)->args)
+          slots.push_back(&arg);
+        break;
+      }
+      case stmt_n::type_t::stmt_call:
+      {
+        auto stmt_call = static_cast<stmt_n::stmt_call_t*>(stmt);
+        slots.push_back(&stmt_call->name);
+        for (auto& arg : stmt_call->args)
+          slots.push_back(&arg);
+        break;
+      }
+      case stmt_n::type_t::stmt_defn:
+      {
+        slots.push_back(&static_cast<stmt_n::stmt_defn_t*>(stmt)->body);
+        break;
+      }
+      case stmt_n::type_t::stmt_defvar:
+      {
+        slots.push_back(&static_cast<stmt_n::stmt_defvar_t*>(stmt)->body);
+        break;
+      }
+      case stmt_n::type_t::stmt_if:
+      {
+        auto stmt_if = static_cast<stmt_n::stmt_if_t*>(stmt);
+        slots.push_back(&stmt_if->expr_if);
+        slots.push_back(&stmt_if->expr_then);
+        slots.push_back(&stmt_if->expr_else);
+        break;
+      }
+      case stmt_n::type_t::stmt_syscall:
+      {
+        for (auto& arg : static_cast<stmt_n::stmt_syscall_t*>(stmt)->args)
+          slots.push_back(&arg);
+        break;
+      }
+      default:
+      {
+        break;
+      }
+    }
+    return slots;
+  }
+
+  stmt_ptr_t copy(stmt_ptr_t stmt, arena_n::arena_t& arena) {
+    // child spans are duplicated, so the copy can be rewritten without touching the original
+    stmt_ptr_t stmt_new = {};
+    switch (stmt->type()) {
+      case stmt_n::type_t::stmt_arg:     stmt_new = arena.make<stmt_n::stmt_arg_t>(*static_cast<stmt_n::stmt_arg_t*>(stmt));         break;
+      case stmt_n::type_t::stmt_block:   stmt_new = arena.make<stmt_n::stmt_block_t>(*static_cast<stmt_n::stmt_block_t*>(stmt));     break;
+      case stmt_n::type_t::stmt_call:    stmt_new = arena.make<stmt_n::stmt_call_t>(*static_cast<stmt_n::stmt_call_t*>(stmt));       break;
+      case stmt_n::type_t::stmt_defvar:  stmt_new = arena.make<stmt_n::stmt_defvar_t>(*static_cast<stmt_n::stmt_defvar_t*>(stmt));   break;
+      case stmt_n::type_t::stmt_func:    stmt_new = arena.make<stmt_n::stmt_func_t>(*static_cast<stmt_n::stmt_func_t*>(stmt));       break;
+      case stmt_n::type_t::stmt_if:      stmt_new = arena.make<stmt_n::stmt_if_t>(*static_cast<stmt_n::stmt_if_t*>(stmt));           break;
+      case stmt_n::type_t::stmt_int:     stmt_new = arena.make<stmt_n::stmt_int_t>(*static_cast<stmt_n::stmt_int_t*>(stmt));         break;
+      case stmt_n::type_t::stmt_syscall: stmt_new = arena.make<stmt_n::stmt_syscall_t>(*static_cast<stmt_n::stmt_syscall_t*>(stmt)); break;
+      case stmt_n::type_t::stmt_var:     stmt_new = arena.make<stmt_n::stmt_var_t>(*static_cast<stmt_n::stmt_var_t*>(stmt));         break;
+      default:                           throw utils_n::fatal_error_t("optimizer: can not copy type_t " + std::to_string(static_cast<size_t>(stmt->type())));
+    }
+
+    if (auto stmt_block = dynamic_cast<stmt_n::stmt_block_t*>(stmt_new))
+      stmt_block->args = arena.array<stmt_ptr_t>(stmt_block->args);
+    if (auto stmt_call = dynamic_cast<stmt_n::stmt_call_t*>(stmt_new))
+      stmt_call->args = arena.array<stmt_ptr_t>(stmt_call->args);
+    if (auto stmt_syscall = dynamic_cast<stmt_n::stmt_syscall_t*>(stmt_new))
+      stmt_syscall->args = arena.array<stmt_ptr_t>(stmt_syscall->args);
+    return stmt_new;
+  }
+
+  stmt_ptr_t clone(stmt_ptr_t stmt, clone_ctx_t& ctx) {
+    // (arg k) is replaced by the k-th argument of the call site, locals get fresh var infos
+    if (auto stmt_arg = dynamic_cast<stmt_n::stmt_arg_t*>(stmt); stmt_arg && ctx.args) {
+      clone_ctx_t ctx_arg = {.arena = ctx.arena};
+      return clone(ctx.args->at(static_cast<size_t>(stmt_arg->value - 1)), ctx_arg);
+    }
+
+    auto stmt_new = copy(stmt, *ctx.arena);
+    switch (stmt_new->type()) {
+      case stmt_n::type_t::stmt_call:
+      {
+        static_cast<stmt_n::stmt_call_t*>(stmt_new)->tail = false;
+        break;
+      }
+      case stmt_n::type_t::stmt_defvar:
+      {
+        auto& var = static_cast<stmt_n::stmt_defvar_t*>(stmt_new)->var;
+        auto var_new = std::make_shared<env_n::var_info_t>(*var);
+        var_new->id = env_n::env_t::id++;
+        ctx.vars[var.get()] = var_new;
+        var = var_new;
+        break;
+      }
+      case stmt_n::type_t::stmt_var:
+      {
+        auto& var = static_cast<stmt_n::stmt_var_t*>(stmt_new)->var;
+        if (auto it = ctx.vars.find(var.get()); it != ctx.vars.end())
+          var = it->second;
+        break;
+      }
+      default:
+      {
+        break;
+      }
+    }
+
+    for (auto slot : children(stmt_new)) {
+      *slot = clone(*slot, ctx);
+    }
+    return stmt_new;
+  }
+
+  bool trivial(stmt_ptr_t stmt) {
+    switch (stmt->type()) {
+      case stmt_n::type_t::stmt_arg:
+      case stmt_n::type_t::stmt_func:
+      case stmt_n::type_t::stmt_int:
+      case stmt_n::type_t::stmt_var:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  size_t cost(stmt_ptr_t stmt) {
+    size_t value = 1;
+    for (auto slot : children(stmt)) {
+      value += cost(*slot);
+    }
+    return value;
+  }
+
+  int64_t arity(stmt_ptr_t stmt) {
+    // the highest (arg k) referenced by the body, -1 if the body reads the frame header
+    if (auto stmt_arg = dynamic_cast<stmt_n::stmt_arg_t*>(stmt))
+      return stmt_arg->value < 1 ? -1 : stmt_arg->value;
+
+    int64_t value = {};
+    for (auto slot : children(stmt)) {
+      auto value_child = arity(*slot);
+      if (value_child < 0) return -1;
+      value = std::max(value, value_child);
+    }
+    return value;
+  }
+
+
+
+  struct inliner_t {
+    struct func_t {
+      stmt_n::stmt_defn_t* defn      = {};
+      std::vector<func_t*> callees   = {};
+      size_t               index     = npos;
+      size_t               low       = {};
+      bool                 stack     = {};
+      bool                 recursive = {};
+      bool                 done      = {};
+      size_t               cost      = {};
+      int64_t              arity     = {};
+    };
+
+    static inline const size_t npos = -1;
+
+    arena_n::arena_t*                                     arena     = {};
+    size_t                                                threshold = {};
+    size_t                                                inlined   = {};
+    std::unordered_map<const env_n::var_info_t*, func_t> funcs     = {};
+    std::vector<func_t*>                                  stack     = {};
+    std::vector<func_t*>                                  order     = {};
+    size_t                                                index     = {};
+
+    func_t* callee(stmt_ptr_t stmt) {
+      auto stmt_call = dynamic_cast<stmt_n::stmt_call_t*>(stmt);
+      if (!stmt_call) return nullptr;
+      auto stmt_func = dynamic_cast<stmt_n::stmt_func_t*>(stmt_call->name);
+      if (!stmt_func) return nullptr;
+      auto it = funcs.find(stmt_func->var.get());
+      return it != funcs.end() ? &it->second : nullptr;
+    }
+
+    void collect(func_t& func, stmt_ptr_t stmt) {
+      if (auto func_callee = callee(stmt)) {
+        func.callees.push_back(func_callee);
+        func.recursive |= func_callee == &func;
+      }
+      for (auto slot : children(stmt)) {
+        collect(func, *slot);
+      }
+    }
+
+    void visit(func_t& func) {
+      // tarjan: strongly connected components come out callees first
+      func.index = func.low = index++;
+      func.stack = true;
+      stack.push_back(&func);
+
+      for (auto func_callee : func.callees) {
+        if (func_callee->index == npos) {
+          visit(*func_callee);
+          func.low = std::min(func.low, func_callee->low);
+        } else if (func_callee->stack) {
+          func.low = std::min(func.low, func_callee->index);
+        }
+      }
+
+      if (func.low != func.index) return;
+
+      std::vector<func_t*> component;
+      do {
+        component.push_back(stack.back());
+        stack.back()->stack = false;
+        stack.pop_back();
+      } while (component.back() != &func);
+
+      for (auto func_component : component) {
+        func_component->recursive |= component.size() > 1;
+        order.push_back(func_component);
+      }
+    }
+
+    bool inlinable(const func_t& func, size_t args) const {
+      return func.done
+        && !func.recursive
+        && !func.defn->var->native
+        && func.cost <= threshold
+        && func.arity >= 0
+        && static_cast<size_t>(func.arity) <= args;
+    }
+
+    stmt_ptr_t expand(stmt_n::stmt_call_t* stmt_call, const func_t& func) {
+      // arguments are evaluated once, in the order of the call, non trivial ones are bound to locals
+      std::vector<stmt_ptr_t> block_args;
+      std::vector<stmt_ptr_t> args(stmt_call->args.size());
+
+      for (size_t k = args.size(); k-- > 0; ) {
+        const auto& arg = stmt_call->args[k];
+        if (trivial(arg)) {
+          args[k] = arg;
+          continue;
+        }
+
+        auto defvar = arena->make<stmt_n::stmt_defvar_t>();
+        defvar->var = std::make_shared<env_n::var_info_t>();
+        defvar->var->id = env_n::env_t::id++;
+        defvar->var->name = func.defn->var->name + "." + std::to_string(k + 1);
+        defvar->body = arg;
+        block_args.push_back(defvar);
+
+        auto var = arena->make<stmt_n::stmt_var_t>();
+        var->var = defvar->var;
+        args[k] = var;
+      }
+
+      clone_ctx_t ctx = {.arena = arena, .args = &args};
+      auto body = clone(func.defn->body, ctx);
+      if (block_args.empty())
+        return body;
+
+      block_args.push_back(body);
+      auto block = arena->make<stmt_n::stmt_block_t>();
+      block->args = arena->array<stmt_ptr_t>(block_args);
+      return block;
+    }
+
+    stmt_ptr_t rewrite(stmt_ptr_t stmt) {
+      for (auto slot : children(stmt)) {
+        *slot = rewrite(*slot);
+      }
+
+      auto func = callee(stmt);
+      if (!func) return stmt;
+
+      auto stmt_call = static_cast<stmt_n::stmt_call_t*>(stmt);
+      if (!inlinable(*func, stmt_call->args.size())) return stmt;
+
+      AML_LOGGER(debug, "inline: {}", func->defn->var->name);
+      inlined++;
+      return expand(stmt_call, *func);
+    }
+
+    size_t process(stmt_n::stmt_program_t* program) {
+      for (const auto& stmt : program->funcs) {
+        auto defn = static_cast<stmt_n::stmt_defn_t*>(stmt);
+        funcs[defn->var.get()].defn = defn;
+      }
+
+      for (auto& [var, func] : funcs) {
+        collect(func, func.defn->body);
+      }
+
+      for (const auto& stmt : program->funcs) {
+        auto& func = funcs[static_cast<stmt_n::stmt_defn_t*>(stmt)->var.get()];
+        if (func.index == npos) visit(func);
+      }
+
+      for (auto func : order) {
+        func->defn->body = rewrite(func->defn->body);
+        stmt_n::stmt_t::mark_tail(func->defn->body);
+        func->cost  = cost(func->defn->body);
+        func->arity = arity(func->defn->body);
+        func->done  = true;
+      }
+
+      program->body = rewrite(program->body);
+      return inlined;
+    }
+  };
+
+
+
+  size_t inline_calls(stmt_ptr_t stmt, size_t threshold, arena_n::arena_t& arena) {
+    AML_TRACER;
+    auto program = dynamic_cast<stmt_n::stmt_program_t*>(stmt);
+    if (!program || !threshold) return {};
+
+    inliner_t inliner = {.arena = &arena, .threshold = threshold};
+    return inliner.process(program);
+  }
+
+
+
+  struct folder_t {
+    arena_n::arena_t* arena  = {};
+    size_t            folded = {};
+
+    static bool constant(stmt_ptr_t stmt) {
+      return stmt->type() == stmt_n::type_t::stmt_int;
+    }
+
+    static int64_t value(stmt_ptr_t stmt) {
+      return static_cast<stmt_n::stmt_int_t*>(stmt)->value;
+    }
+
+    stmt_ptr_t eval(const code_n::native_t* native, stmt_n::stmts_t args) {
+      if (!native || native->arity != args.size()) return nullptr;
+      if (!std::all_of(args.begin(), args.end(), constant)) return nullptr;
+
+      int64_t a = value(args[0]);
+      int64_t b = args.size() > 1 ? value(args[1]) : int64_t{};
+      // the overflow of the vm division is left to the runtime
+      if (native->id == code_n::cmd_id_t::div && a == std::numeric_limits<int64_t>::min() && b == -1)
+        return nullptr;
+
+      auto stmt_int = arena->make<stmt_n::stmt_int_t>();
+      stmt_int->value = code_n::eval_native(native->id, a, b);
+      return stmt_int;
+    }
+
+    stmt_ptr_t fold(stmt_ptr_t stmt) {
+      switch (stmt->type()) {
+        case stmt_n::type_t::stmt_call:
+        {
+          auto stmt_call = static_cast<stmt_n::stmt_call_t*>(stmt);
+          auto stmt_func = dynamic_cast<stmt_n::stmt_func_t*>(stmt_call->name);
+          return stmt_func ? eval(stmt_func->var->native, stmt_call->args) : nullptr;
+        }
+        case stmt_n::type_t::stmt_syscall:
+        {
+          auto stmt_syscall = static_cast<stmt_n::stmt_syscall_t*>(stmt);
+          if (!constant(stmt_syscall->args.front())) return nullptr;
+          auto args = stmt_syscall->args.subspan(1);
+          return eval(code_n::find_native(value(stmt_syscall->args.front()), args.size()), args);
+        }
+        case stmt_n::type_t::stmt_if:
+        {
+          auto stmt_if = static_cast<stmt_n::stmt_if_t*>(stmt);
+          if (!constant(stmt_if->expr_if)) return nullptr;
+          return value(stmt_if->expr_if) ? stmt_if->expr_then : stmt_if->expr_else;
+        }
+        case stmt_n::type_t::stmt_block:
+        {
+          // only the last value of a block is returned, the others are kept for their side effects
+          auto stmt_block = static_cast<stmt_n::stmt_block_t*>(stmt);
+          auto& args = stmt_block->args;
+          auto it = std::remove_if(args.begin(), args.end() - 1, trivial);
+          auto removed = static_cast<size_t>(args.end() - 1 - it);
+          if (removed) {
+            *it = args.back();
+            args = args.first(static_cast<size_t>(it - args.begin()) + 1);
+          }
+          folded += removed;
+          if (args.size() == 1 && args.front()->type() != stmt_n::type_t::stmt_defvar)
+            return args.front();
+          return nullptr;
+        }
+        default:
+        {
+          return nullptr;
+        }
+      }
+    }
+
+    stmt_ptr_t rewrite(stmt_ptr_t stmt) {
+      for (auto slot : children(stmt)) {
+        *slot = rewrite(*slot);
+      }
+
+      auto stmt_new = fold(stmt);
+      if (!stmt_new) return stmt;
+
+      AML_LOGGER(debug, "fold: {}", stmt->show({}));
+      folded++;
+      return stmt_new;
+    }
+
+    size_t process(stmt_n::stmt_program_t* program) {
+      for (const auto& stmt : program->funcs) {
+        auto defn = static_cast<stmt_n::stmt_defn_t*>(stmt);
+        defn->body = rewrite(defn->body);
+      }
+      program->body = rewrite(program->body);
+      return folded;
+    }
+  };
+
+
+
+  size_t fold_constants(stmt_ptr_t stmt, arena_n::arena_t& arena) {
+    AML_TRACER;
+    auto program = dynamic_cast<stmt_n::stmt_program_t*>(stmt);
+    if (!program) return {};
+
+    folder_t folder = {.arena = &arena};
+    return folder.process(program);
+  }
+
+
+
+  struct purity_t {
+    struct func_t {
+      stmt_n::stmt_defn_t* defn    = {};
+      bool                 pure    = true;
+      bool                 calls   = {};
+      std::vector<func_t*> callees = {};
+    };
+
+    std::unordered_map<const env_n::var_info_t*, func_t> funcs = {};
+
+    // false for stmts with effects or calls through a value, the defns called by name are collected
+    bool collect(func_t& func, stmt_ptr_t stmt) {
+      if (auto stmt_syscall = dynamic_cast<stmt_n::stmt_syscall_t*>(stmt)) {
+        auto op = dynamic_cast<stmt_n::stmt_int_t*>(stmt_syscall->args.front());
+        if (!op || !code_n::find_native(op->value, stmt_syscall->args.size() - 1))
+          return false;
+      }
+
+      if (auto stmt_call = dynamic_cast<stmt_n::stmt_call_t*>(stmt)) {
+        auto stmt_func = dynamic_cast<stmt_n::stmt_func_t*>(stmt_call->name);
+        if (!stmt_func)
+          return false;
+        if (!stmt_func->var->native) {
+          auto it = funcs.find(stmt_func->var.get());
+          if (it == funcs.end())
+            return false;
+          func.callees.push_back(&it->second);
+          func.calls = true;
+        }
+      }
+
+      for (auto slot : children(stmt)) {
+        if (!collect(func, *slot))
+          return false;
+      }
+      return true;
+    }
+
+    size_t process(stmt_n::stmt_program_t* program, bool memoize) {
+      for (const auto& stmt : program->funcs) {
+        auto defn = static_cast<stmt_n::stmt_defn_t*>(stmt);
+        funcs[defn->var.get()].defn = defn;
+      }
+
+      for (auto& [var, func] : funcs) {
+        func.pure = collect(func, func.defn->body) && arity(func.defn->body) >= 0;
+      }
+
+      // impurity spreads to the callers until nothing changes
+      for (bool changed = true; changed; ) {
+        changed = false;
+        for (auto& [var, func] : funcs) {
+          if (func.pure && std::any_of(func.callees.begin(), func.callees.end(), [](auto callee) { return !callee->pure; })) {
+            func.pure = false;
+            changed = true;
+          }
+        }
+      }
+
+      // leaf defns are cheaper to evaluate than to look up
+      size_t pure = {};
+      int64_t id = {};
+      for (const auto& stmt : program->funcs) {
+        auto defn = static_cast<stmt_n::stmt_defn_t*>(stmt);
+        const auto& func = funcs[defn->var.get()];
+        auto args = arity(defn->body);
+        defn->pure = func.pure;
+        defn->memo = memoize && func.pure && func.calls && args <= static_cast<int64_t>(code_n::memo_t::args_max)
+          ? id++ << code_n::memo_t::arity_bits | args
+          : -1;
+        // a tail call would return past memo_ret, the result of a memoized defn comes back to it
+        if (defn->memo >= 0)
+          stmt_n::stmt_t::mark_tail(defn->body, false);
+        pure += func.pure;
+        AML_LOGGER(debug, "defn: {} pure: {} memo: {}", defn->var->name, defn->pure, defn->memo);
+      }
+      return pure;
+    }
+  };
+
+
+
+  size_t mark_pure(stmt_ptr_t stmt, bool memoize) {
+    AML_TRACER;
+    auto program = dynamic_cast<stmt_n::stmt_program_t*>(stmt);
+    if (!program) return {};
+
+    purity_t purity;
+    return purity.process(program, memoize);
+  }
+}
@@ -0,0 +1,120 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "logger.h"
+
+namespace aml::profile_n {
+  void profile_t::prepare(const code_n::program_t& program, const std::vector<code_n::label_t>& labels) {
+    AML_TRACER;
+    *this = {};
+    funcs.push_back({.name = root, .calls = 1, .active = 1});
+    nodes.push_back({});
+    frames.push_back({});
+
+    for (const auto& label : labels) {
+      entries[program.target(label.offset)] = funcs.size();
+      funcs.push_back({.name = label.name});
+    }
+  }
+
+  void profile_t::enter(size_t rip) {
+    // images without the symbols section show their functions by the entry
+    auto [it, inserted] = entries.emplace(rip, funcs.size());
+    if (inserted)
+      funcs.push_back({.name = "func_" + std::to_string(rip)});
+    size_t func = it->second;
+    funcs[func].calls++;
+    funcs[func].active++;
+
+    size_t parent = frames.back().node;
+    auto [child, created] = nodes[parent].children.emplace(func, nodes.size());
+    if (created)
+      nodes.push_back({.parent = parent, .func = func});
+
+    frames.push_back({.node = child->second, .start = total});
+    max_depth = std::max(max_depth, frames.size());
+  }
+
+  void profile_t::leave() {
+    if (frames.size() == 1)
+      return;
+    auto frame = frames.back();
+    frames.pop_back();
+    auto& func = funcs[nodes[frame.node].func];
+    if (!--func.active)
+      func.inclusive += total - frame.start;
+  }
+
+  void profile_t::finish() {
+    AML_TRACER;
+    while (frames.size() > 1)
+      leave();
+    funcs.front().inclusive = total;
+    for (auto& func : funcs)
+      func.exclusive = {};
+    for (const auto& node : nodes)
+      funcs[node.func].exclusive += node.self;
+  }
+
+
+
+  std::string profile_t::report() const {
+    std::stringstream ss;
+    ss << "instructions: " << total     << std::endl;
+    ss << "max stack:    " << max_stack << std::endl;
+    ss << "max depth:    " << max_depth << std::endl;
+
+    auto percent = [this](size_t count) {
+      return total ? 100.0 * static_cast<double>(count) / static_cast<double>(total) : 0;
+    };
+
+    ss << std::endl << std::left << std::setw(12) << "cmd" << std::right << std::setw(14) << "count" << std::setw(8) << "%" << std::endl;
+    for (size_t id{}; id < cmds.size(); ++id) {
+      if (!cmds[id])
+        continue;
+      ss << std::left << std::setw(12) << code_n::show(static_cast<code_n::cmd_id_t>(id)) << std::right
+        << std::setw(14) << cmds[id] << std::setw(8) << std::fixed << std::setprecision(1) << percent(cmds[id]) << std::endl;
+    }
+
+    std::vector<const func_t*> sorted;
+    for (const auto& func : funcs) {
+      if (func.calls)
+        sorted.push_back(&func);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto lhs, auto rhs) { return lhs->exclusive > rhs->exclusive; });
+
+    ss << std::endl << std::left << std::setw(24) << "func" << std::right << std::setw(12) << "calls"
+      << std::setw(14) << "inclusive" << std::setw(8) << "%" << std::setw(14) << "exclusive" << std::setw(8) << "%" << std::endl;
+    for (auto func : sorted) {
+      ss << std::left << std::setw(24) << func->name << std::right << std::setw(12) << func->calls
+        << std::setw(14) << func->inclusive << std::setw(8) << percent(func->inclusive)
+        << std::setw(14) << func->exclusive << std::setw(8) << percent(func->exclusive) << std::endl;
+    }
+    return ss.str();
+  }
+
+  std::string profile_t::collapsed() const {
+    // one line per call path: main;caller;callee <instructions executed in the callee itself>
+    std::string str;
+    for (const auto& node : nodes) {
+      if (!node.self)
+        continue;
+      std::vector<size_t> path;
+      for (const auto* it = &node; ; it = &nodes[it->parent]) {
+        path.push_back(it->func);
+        if (it == &nodes.front())
+          break;
+      }
+      for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        str += funcs[*it].name;
+        str += it + 1 != path.rend() ? ';' : ' ';
+      }
+      str += std::to_string(node.self);
+      str += '\n';
+    }
+    return str;
+  }
+}
@@ -0,0 +1,118 @@
+#include "scheduler.h"
+
+#include <sstream>
+
+#include "logger.h"
+
+namespace aml::scheduler_n {
+  static double seconds(duration_t duration) {
+    return std::chrono::duration<double>(duration).count();
+  }
+
+  double counters_t::latency_mean_us() const {
+    return slices ? seconds(latency) * 1e6 / static_cast<double>(slices) : 0;
+  }
+
+  double counters_t::cmds_per_s() const {
+    return running.count() ? static_cast<double>(cmds) / seconds(running) : 0;
+  }
+
+  double counters_t::tasks_per_s() const {
+    return running.count() ? static_cast<double>(completed + failed) / seconds(running) : 0;
+  }
+
+  std::string counters_t::show() const {
+    std::stringstream ss;
+    ss << "spawned:          " << spawned                       << std::endl;
+    ss << "completed:        " << completed                     << std::endl;
+    ss << "failed:           " << failed                        << std::endl;
+    ss << "slices:           " << slices                        << std::endl;
+    ss << "yields:           " << yields                        << std::endl;
+    ss << "cmds:             " << cmds                          << std::endl;
+    ss << "latency mean us:  " << latency_mean_us()             << std::endl;
+    ss << "latency max us:   " << seconds(latency_max) * 1e6    << std::endl;
+    ss << "cmds per s:       " << cmds_per_s()                  << std::endl;
+    ss << "tasks per s:      " << tasks_per_s()                 << std::endl;
+    return ss.str();
+  }
+
+
+
+  scheduler_t::scheduler_t(options_t options, done_t done)
+    : options(options), done(std::move(done)) { }
+
+  size_t scheduler_t::spawn(aml_n::program_sptr_t program, std::span<const int64_t> args, size_t priority) {
+    AML_TRACER;
+    if (free.empty()) {
+      tasks.push_back(std::make_unique<task_t>(options.stack_capacity, options.heap_capacity));
+      free.push_back(tasks.back().get());
+    }
+    auto task = free.back();
+    free.pop_back();
+
+    task->id       = counters.spawned++;
+    task->program  = std::move(program);
+    task->priority = priority;
+    task->cmds     = {};
+
+    // no fuel: the frame of the args is set up and the task is suspended before its first cmd
+    auto result = aml_n::execute(*task->program, args, task->stack, 0);
+    if (result.status == aml_n::status_t::suspended)
+      push(task);
+    else
+      finish(task, result);
+    return task->id;
+  }
+
+  void scheduler_t::push(task_t* task) {
+    task->ready = std::chrono::steady_clock::now();
+    auto priority = options.policy == policy_t::priority ? task->priority : 0;
+    queue.push({.priority = priority, .sequence = sequence++, .task = task});
+  }
+
+  void scheduler_t::finish(task_t* task, const aml_n::result_t& result) {
+    AML_LOGGER(debug, "task: {} status: {} cmds: {}", task->id, static_cast<int>(result.status), task->cmds);
+    result ? counters.completed++ : counters.failed++;
+    if (done)
+      done(task->id, result);
+    task->program = {};
+    free.push_back(task);
+  }
+
+  bool scheduler_t::step() {
+    if (queue.empty())
+      return false;
+    auto task = queue.top().task;
+    queue.pop();
+
+    auto start = std::chrono::steady_clock::now();
+    auto wait  = start - task->ready;
+    counters.slices++;
+    counters.latency += wait;
+    counters.latency_max = std::max(counters.latency_max, wait);
+
+    auto fuel   = std::min(options.slice, options.budget - task->cmds);
+    auto result = aml_n::resume(*task->program, task->stack, fuel);
+    counters.running += std::chrono::steady_clock::now() - start;
+    counters.cmds += result.cmds;
+    task->cmds    += result.cmds;
+
+    if (result.status != aml_n::status_t::suspended) {
+      finish(task, result);
+    } else if (task->stack.yield) {
+      counters.yields++;
+      push(task);
+    } else if (task->cmds >= options.budget) {
+      finish(task, {.status = aml_n::status_t::error,
+          .error = "budget of " + std::to_string(options.budget) + " cmds is exhausted", .cmds = result.cmds});
+    } else {
+      push(task);
+    }
+    return true;
+  }
+
+  void scheduler_t::run() {
+    AML_TRACER;
+    while (step()) { }
+  }
+}
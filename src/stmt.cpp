@@ -1,50 +1,122 @@
 #include "stmt.h"
 
+#include <array>
+#include <atomic>
 #include <filesystem>
 #include <ranges>
+#include <thread>
 
 #include "logger.h"
+#include "module.h"
 
 namespace aml::stmt_n {
 
   syntax_error_t::syntax_error_t(const std::string& filename, const token_n::token_t& token)
     : utils_n::fatal_error_t("synax error in '" + filename
-        + "' at or near '" + token.lexeme
+        + "' at or near '" + std::string(token.lexeme)
         + "' at '" + token.pos.show() + "'") { }
 
 
 
-  std::shared_ptr<stmt_t> stmt_t::factory(type_t type) {
+  static constexpr auto heads = [] {
+    std::array<type_t, static_cast<size_t>(token_n::type_t::eof) + 1> heads = {};
+    heads[static_cast<size_t>(token_n::type_t::key_arg)]     = type_t::stmt_arg;
+    heads[static_cast<size_t>(token_n::type_t::key_block)]   = type_t::stmt_block;
+    heads[static_cast<size_t>(token_n::type_t::key_call)]    = type_t::stmt_call;
+    heads[static_cast<size_t>(token_n::type_t::key_defn)]    = type_t::stmt_defn;
+    heads[static_cast<size_t>(token_n::type_t::key_defvar)]  = type_t::stmt_defvar;
+    heads[static_cast<size_t>(token_n::type_t::key_func)]    = type_t::stmt_func;
+    heads[static_cast<size_t>(token_n::type_t::key_if)]      = type_t::stmt_if;
+    heads[static_cast<size_t>(token_n::type_t::key_include)] = type_t::stmt_include;
+    heads[static_cast<size_t>(token_n::type_t::key_int)]     = type_t::stmt_int;
+    heads[static_cast<size_t>(token_n::type_t::key_syscall)] = type_t::stmt_syscall;
+    heads[static_cast<size_t>(token_n::type_t::key_var)]     = type_t::stmt_var;
+    return heads;
+  }();
+
+
+
+  stmt_t* stmt_t::factory(type_t type, arena_n::arena_t& arena) {
     AML_TRACER;
     switch (type) {
-      case type_t::stmt_stub:    return std::make_shared<stmt_stub_t>();    break;
-      case type_t::stmt_program: return std::make_shared<stmt_program_t>(); break;
-      case type_t::stmt_arg:     return std::make_shared<stmt_arg_t>();     break;
-      case type_t::stmt_call:    return std::make_shared<stmt_call_t>();    break;
-      case type_t::stmt_block:   return std::make_shared<stmt_block_t>();   break;
-      case type_t::stmt_defn:    return std::make_shared<stmt_defn_t>();    break;
-      case type_t::stmt_defvar:  return std::make_shared<stmt_defvar_t>();  break;
-      case type_t::stmt_func:    return std::make_shared<stmt_func_t>();    break;
-      case type_t::stmt_if:      return std::make_shared<stmt_if_t>();      break;
-      case type_t::stmt_include: return std::make_shared<stmt_include_t>(); break;
-      case type_t::stmt_int:     return std::make_shared<stmt_int_t>();     break;
-      case type_t::stmt_syscall: return std::make_shared<stmt_syscall_t>(); break;
-      case type_t::stmt_var:     return std::make_shared<stmt_var_t>();     break;
+      case type_t::stmt_stub:    return arena.make<stmt_stub_t>();    break;
+      case type_t::stmt_program: return arena.make<stmt_program_t>(); break;
+      case type_t::stmt_arg:     return arena.make<stmt_arg_t>();     break;
+      case type_t::stmt_call:    return arena.make<stmt_call_t>();    break;
+      case type_t::stmt_block:   return arena.make<stmt_block_t>();   break;
+      case type_t::stmt_defn:    return arena.make<stmt_defn_t>();    break;
+      case type_t::stmt_defvar:  return arena.make<stmt_defvar_t>();  break;
+      case type_t::stmt_func:    return arena.make<stmt_func_t>();    break;
+      case type_t::stmt_if:      return arena.make<stmt_if_t>();      break;
+      case type_t::stmt_include: return arena.make<stmt_include_t>(); break;
+      case type_t::stmt_int:     return arena.make<stmt_int_t>();     break;
+      case type_t::stmt_syscall: return arena.make<stmt_syscall_t>(); break;
+      case type_t::stmt_var:     return arena.make<stmt_var_t>();     break;
       default:                   throw utils_n::fatal_error_t("unknown type_t " + std::to_string(static_cast<size_t>(type)));
     }
   }
 
-  std::shared_ptr<stmt_t> stmt_t::parse(const lisp_tree_n::lisp_tree_t& tree,
+  const code_n::native_t* stmt_t::native(const stmt_t* body) {
+    // (syscall (int <op>) (arg 1) ... (arg N)) wrappers are replaced by native cmds at call sites
+    auto syscall = dynamic_cast<const stmt_syscall_t*>(body);
+    if (!syscall) return nullptr;
+
+    auto op = dynamic_cast<stmt_int_t*>(syscall->args.front());
+    if (!op) return nullptr;
+
+    for (size_t i = 1; i < syscall->args.size(); ++i) {
+      auto arg = dynamic_cast<stmt_arg_t*>(syscall->args[i]);
+      if (!arg || arg->value != static_cast<int64_t>(i)) return nullptr;
+    }
+
+    return code_n::find_native(op->value, syscall->args.size() - 1);
+  }
+
+  void stmt_t::mark_tail(stmt_t* body, bool tail) {
+    // calls whose result is returned as is can reuse the frame of the caller, unless the caller stores the result
+    switch (body->type()) {
+      case type_t::stmt_call:
+      {
+        static_cast<stmt_call_t*>(body)->tail = tail;
+        break;
+      }
+      case type_t::stmt_if:
+      {
+        auto stmt_if = static_cast<stmt_if_t*>(body);
+        mark_tail(stmt_if->expr_then, tail);
+        mark_tail(stmt_if->expr_else, tail);
+        break;
+      }
+      case type_t::stmt_block:
+      {
+        mark_tail(static_cast<stmt_block_t*>(body)->args.back(), tail);
+        break;
+      }
+      default:
+      {
+        break;
+      }
+    }
+  }
+
+  stmt_t* stmt_t::parse(const lisp_tree_n::lisp_tree_t& tree,
       env_n::env_sptr_t env, const types_t& types, options_t& options) {
     AML_TRACER;
 
-    for (const auto type : types) {
-      auto stmt = factory(type);
-      if (stmt->parse_v(tree, env, options))
-        return stmt;
-    }
+    // the head keyword selects the stmt, a list without it can only be a program
+    auto type = type_t::unknown;
+    if (!tree.is_leaf() && !tree.nodes.empty() && tree.nodes.front().is_leaf())
+      type = heads[static_cast<size_t>(tree.nodes.front().node.type)];
+    if (type == type_t::unknown && !tree.is_leaf())
+      type = type_t::stmt_program;
+
+    if (std::find(types.begin(), types.end(), type) == types.end())
+      throw syntax_error_t(options.filename, tree.node);
 
-    throw syntax_error_t(options.filename, tree.node);
+    auto stmt = factory(type, *options.arena);
+    if (!stmt->parse_v(tree, env, options))
+      throw syntax_error_t(options.filename, tree.node);
+    return stmt;
   }
 
 
@@ -68,26 +140,30 @@ namespace aml::stmt_n {
     AML_TRACER;
     if (tree.is_leaf()) return false;
 
-    env  = env ? env : std::make_shared<env_n::env_t>(env);
-    body = factory(type_t::stmt_stub);
+    env  = env ? env : std::make_shared<env_n::env_t>();
+    body = factory(type_t::stmt_stub, *options.arena);
 
-    for (const auto& node : tree.nodes) {
-      auto stmt = parse(node, env, types_program, options);
+    std::vector<stmt_t*> funcs_all;
+    items = options.arena->array<stmt_t*>(tree.nodes.size());
+    for (size_t i{}; i < items.size(); ++i) {
+      const auto& node = tree.nodes[i];
+      auto stmt = items[i] = parse(node, env, types_program, options);
       switch (stmt->type()) {
-        case type_t::stmt_defn:      funcs.push_back(stmt); break;
-        case type_t::stmt_call:      body = stmt;           break;
+        case type_t::stmt_defn:      funcs_all.push_back(stmt); break;
+        case type_t::stmt_call:      body = stmt;               break;
         case type_t::stmt_include:
         {
-          auto stmt_include = std::dynamic_pointer_cast<stmt_include_t>(stmt);
+          auto stmt_include = dynamic_cast<stmt_include_t*>(stmt);
           if (!stmt_include) break;
-          auto stmt_program = std::dynamic_pointer_cast<stmt_program_t>(stmt_include->body);
+          auto stmt_program = dynamic_cast<stmt_program_t*>(stmt_include->body);
           if (!stmt_program) break;
-          funcs.insert(funcs.end(), stmt_program->funcs.begin(), stmt_program->funcs.end());
+          funcs_all.insert(funcs_all.end(), stmt_program->funcs.begin(), stmt_program->funcs.end());
           break;
         }
         default: throw syntax_error_t(options.filename, node.node);
       }
     }
+    funcs = options.arena->array<stmt_t*>(funcs_all);
     return true;
   }
 
@@ -106,13 +182,44 @@ namespace aml::stmt_n {
 
   void stmt_program_t::intermediate_code(code_n::code_ctx_t& code_ctx) const {
     AML_TRACER;
-    for (const auto& func : funcs) {
-      func->intermediate_code(code_ctx);
+    // defns are generated into their own buffers, by several threads for large programs,
+    // and laid out in source order, calls are linked when every address is known
+    std::vector<code_n::code_ctx_t> code_funcs(funcs.size());
+    std::atomic<size_t> next = {};
+    std::vector<std::exception_ptr> errors(funcs.size());
+    auto worker = [&]() {
+      for (size_t i; (i = next++) < funcs.size(); ) {
+        try {
+          funcs[i]->intermediate_code(code_funcs[i]);
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      }
+    };
+
+    auto jobs = std::min(code_ctx.jobs, funcs.size() / funcs_per_job);
+    {
+      std::vector<std::jthread> threads;
+      for (size_t i = 1; i < jobs; ++i)
+        threads.emplace_back(worker);
+      worker();
+    }
+    AML_LOGGER(debug, "funcs: {} jobs: {}", funcs.size(), std::max<size_t>(jobs, 1));
+
+    for (size_t i{}; i < funcs.size(); ++i) {
+      if (errors[i])
+        std::rethrow_exception(errors[i]);
+      const auto& var = static_cast<const stmt_defn_t*>(funcs[i])->var;
+      var->offset = code_ctx.code.buffer.size();
+      code_ctx.labels.push_back({var->offset, var->name});
+      code_ctx.append(code_funcs[i]);
     }
+
     code_ctx.rip = code_ctx.code.buffer.size();
     AML_LOGGER(debug, "rip start: {}", code_ctx.rip);
     body->intermediate_code(code_ctx);
     code_ctx.code.write_cmd({code_n::cmd_id_t::exit});
+    code_ctx.link();
   }
 
 
@@ -141,7 +248,7 @@ namespace aml::stmt_n {
 
   void stmt_arg_t::intermediate_code(code_n::code_ctx_t& code_ctx) const {
     AML_TRACER;
-    code_ctx.code.write_cmd({code_n::cmd_id_t::arg, static_cast<int64_t>(code_ctx.rsp + value + 1/*rbp*/ + 1/*rip*/ + 1)});
+    code_ctx.code.write_cmd({code_n::cmd_id_t::arg, value});
     code_ctx.rsp++;
   }
 
@@ -154,10 +261,10 @@ namespace aml::stmt_n {
 
     if (!check_type(tree.nodes[0], token_n::type_t::key_block)) return false;
 
-    env = std::make_shared<env_n::env_t>(env);
-    for (const auto& node : tree.nodes | std::views::drop(1)) {
-      auto stmt = parse(node, env, types_expr, options);
-      args.push_back(stmt);
+    env_n::scope_t scope(*env);
+    args = options.arena->array<stmt_t*>(tree.nodes.size() - 1);
+    for (size_t i{}; i < args.size(); ++i) {
+      args[i] = parse(tree.nodes[i + 1], env, types_expr, options);
     }
     return true;
   }
@@ -182,6 +289,7 @@ namespace aml::stmt_n {
     }
 
     code_ctx.code.write_cmd({code_n::cmd_id_t::pop, static_cast<int64_t>(args.size())});
+    code_ctx.rsp -= args.size() - 1/*<return>*/;
   }
 
 
@@ -194,9 +302,9 @@ namespace aml::stmt_n {
     if (!check_type(tree.nodes[0], token_n::type_t::key_call)) return false;
 
     name = parse(tree.nodes[1], env, types_expr, options);
-    for (const auto& node : tree.nodes | std::views::drop(2)) {
-      auto stmt = parse(node, env, types_expr, options);
-      args.push_back(stmt);
+    args = options.arena->array<stmt_t*>(tree.nodes.size() - 2);
+    for (size_t i{}; i < args.size(); ++i) {
+      args[i] = parse(tree.nodes[i + 2], env, types_expr, options);
     }
     return true;
   }
@@ -219,6 +327,17 @@ namespace aml::stmt_n {
 
   void stmt_call_t::intermediate_code(code_n::code_ctx_t& code_ctx) const {
     AML_TRACER;
+    if (auto func = dynamic_cast<stmt_func_t*>(name);
+        func && func->var->native && func->var->native->arity == args.size()) {
+      for (const auto& arg : args | std::views::reverse) {
+        arg->intermediate_code(code_ctx);
+      }
+      code_ctx.code.write_cmd({func->var->native->id});
+      code_ctx.rsp -= args.size();
+      code_ctx.rsp += 1/*<return>*/;
+      return;
+    }
+
     name->intermediate_code(code_ctx);
 
     for (const auto& arg : args | std::views::reverse) {
@@ -227,7 +346,7 @@ namespace aml::stmt_n {
     code_ctx.code.write_cmd({code_n::cmd_id_t::push, static_cast<int64_t>(args.size() + 1)});
     code_ctx.rsp++;
 
-    code_ctx.code.write_cmd({code_n::cmd_id_t::call});
+    code_ctx.code.write_cmd({tail ? code_n::cmd_id_t::tail_call : code_n::cmd_id_t::call});
     code_ctx.rsp -= 1/*<count>*/ + (args.size() + 1);
     code_ctx.rsp += 1/*<return>*/;
   }
@@ -243,10 +362,12 @@ namespace aml::stmt_n {
     if (!check_type(tree.nodes[1], token_n::type_t::ident)) return false;
 
 
-    var = env->def_func(std::get<std::string>(tree.nodes[1].node.value));
+    var = env->def_func(std::get<token_n::symbol_t>(tree.nodes[1].node.value));
     AML_LOGGER(debug, "env:\n{}", env->show());
-    env = std::make_shared<env_n::env_t>(env);
+    env_n::scope_t scope(*env);
     body = parse(tree.nodes[2], env, types_expr, options);
+    var->native = native(body);
+    mark_tail(body);
     return true;
   }
 
@@ -265,10 +386,13 @@ namespace aml::stmt_n {
 
   void stmt_defn_t::intermediate_code(code_n::code_ctx_t& code_ctx) const {
     AML_TRACER;
-    var->offset = code_ctx.code.buffer.size();
-    AML_LOGGER(debug, "name: {} {}", var->name, var->offset);
+    AML_LOGGER(debug, "name: {}", var->name);
+    if (memo >= 0)
+      code_ctx.code.write_cmd({code_n::cmd_id_t::memo, memo});
     body->intermediate_code(code_ctx);
-    code_ctx.code.write_cmd({code_n::cmd_id_t::ret});
+    code_ctx.code.write_cmd(memo >= 0
+        ? code_n::cmd_t{code_n::cmd_id_t::memo_ret, memo}
+        : code_n::cmd_t{code_n::cmd_id_t::ret});
     code_ctx.rsp = {};
   }
 
@@ -282,7 +406,7 @@ namespace aml::stmt_n {
     if (!check_type(tree.nodes[0], token_n::type_t::key_defvar)) return false;
     if (!check_type(tree.nodes[1], token_n::type_t::ident)) return false;
 
-    var = env->def_var(std::get<std::string>(tree.nodes[1].node.value));
+    var = env->def_var(std::get<token_n::symbol_t>(tree.nodes[1].node.value));
     AML_LOGGER(debug, "env:\n{}", env->show());
     body = parse(tree.nodes[2], env, types_expr, options);
     return true;
@@ -317,7 +441,7 @@ namespace aml::stmt_n {
     if (!check_type(tree.nodes[0], token_n::type_t::key_func)) return false;
     if (!check_type(tree.nodes[1], token_n::type_t::ident)) return false;
 
-    var = env->get_func(std::get<std::string>(tree.nodes[1].node.value));
+    var = env->get_func(std::get<token_n::symbol_t>(tree.nodes[1].node.value));
     return true;
   }
 
@@ -333,8 +457,8 @@ namespace aml::stmt_n {
 
   void stmt_func_t::intermediate_code(code_n::code_ctx_t& code_ctx) const {
     AML_TRACER;
-    AML_LOGGER(debug, "name: {} {}", var->name, var->offset);
-    code_ctx.code.write_cmd({code_n::cmd_id_t::push, static_cast<int64_t>(var->offset)});
+    AML_LOGGER(debug, "name: {}", var->name);
+    code_ctx.relocs.push_back({code_ctx.code.write_fixup(code_n::cmd_id_t::push), &var->offset});
     code_ctx.rsp++;
   }
 
@@ -373,35 +497,18 @@ namespace aml::stmt_n {
   void stmt_if_t::intermediate_code(code_n::code_ctx_t& code_ctx) const {
     AML_TRACER;
 
-    size_t size_then = {};
-    size_t size_else = {};
-
-    {
-      code_n::code_ctx_t code_ctx_tmp = {};
-      expr_else->intermediate_code(code_ctx_tmp);
-      size_else = code_ctx_tmp.code.buffer.size();
-      AML_LOGGER(debug, "size_else: {}", size_else);
-    }
-
-    {
-      code_n::code_ctx_t code_ctx_tmp = {};
-      expr_then->intermediate_code(code_ctx_tmp);
-      size_then = code_ctx_tmp.code.buffer.size();
-      AML_LOGGER(debug, "size_then: {}", size_then);
-    }
-
-    {
-      code_n::cmd_t cmd = {code_n::cmd_id_t::jmp, static_cast<int64_t>(size_else)};
-      cmd.encode();
-      size_then += 1/*cmd*/ + (cmd.bits.ext ? 0 : cmd.bits.len + 1);
-      AML_LOGGER(debug, "size_then: {}", size_then);
-    }
+    // both branches start with the rsp of the if, each of them leaves one value
+    size_t rsp = code_ctx.rsp;
 
     expr_if->intermediate_code(code_ctx);
-    code_ctx.code.write_cmd({code_n::cmd_id_t::pop_jif, static_cast<int64_t>(size_then)});
+    auto fixup_else = code_ctx.code.write_fixup(code_n::cmd_id_t::pop_jif);
+    code_ctx.rsp--;
     expr_then->intermediate_code(code_ctx);
-    code_ctx.code.write_cmd({code_n::cmd_id_t::jmp, static_cast<int64_t>(size_else)});
+    auto fixup_end = code_ctx.code.write_fixup(code_n::cmd_id_t::jmp);
+    code_ctx.code.patch(fixup_else);
+    code_ctx.rsp = rsp;
     expr_else->intermediate_code(code_ctx);
+    code_ctx.code.patch(fixup_end);
   }
 
 
@@ -414,22 +521,8 @@ namespace aml::stmt_n {
     if (!check_type(tree.nodes[0], token_n::type_t::key_include)) return false;
     if (!check_type(tree.nodes[1], token_n::type_t::dq_string)) return false;
 
-    filename = std::get<std::string>(tree.nodes[1].node.value);
-    body = factory(type_t::stmt_stub);
-
-
-    auto filename_abs = std::filesystem::path(options.filename).parent_path() / filename;
-    AML_LOGGER(debug, "filename current: {}", options.filename);
-    AML_LOGGER(debug, "filename new: {}", filename_abs.string());
-
-    if (!options.files.contains(filename_abs)) {
-      options.files.insert(filename_abs);
-      auto filename = filename_abs.string();
-
-      std::swap(filename, options.filename);
-      body = parse_file(env, options, filename_abs);
-      std::swap(filename, options.filename);
-    }
+    filename = std::get<std::string_view>(tree.nodes[1].node.value);
+    body = include(env, options, filename);
     return true;
   }
 
@@ -447,17 +540,43 @@ namespace aml::stmt_n {
     AML_TRACER;
   }
 
-  std::shared_ptr<stmt_t> stmt_include_t::parse_file(env_n::env_sptr_t env, options_t& options, const std::string& filename) {
+  stmt_t* stmt_include_t::include(env_n::env_sptr_t env, options_t& options, const std::string& filename) {
+    AML_TRACER;
+    auto filename_abs = std::filesystem::path(options.filename).parent_path() / filename;
+    AML_LOGGER(debug, "filename current: {}", options.filename);
+    AML_LOGGER(debug, "filename new: {}", filename_abs.string());
+
+    if (options.files.contains(filename_abs))
+      return factory(type_t::stmt_stub, *options.arena);
+
+    options.files.insert(filename_abs);
+    auto filename_current = filename_abs.string();
+
+    std::swap(filename_current, options.filename);
+    auto stmt = parse_file(env, options, filename_abs);
+    std::swap(filename_current, options.filename);
+    return stmt;
+  }
+
+  stmt_t* stmt_include_t::parse_file(env_n::env_sptr_t env, options_t& options, const std::string& filename) {
     AML_TRACER;
     std::string code = utils_n::str_from_file(filename);
     AML_LOGGER(debug, "filename: {}", filename);
     AML_LOGGER(debug, "code:\n{}", code);
     if (code.empty())
-      return factory(type_t::stmt_stub);
+      return factory(type_t::stmt_stub, *options.arena);
 
-    auto tokens  = token_n::process(code);
+    if (!options.module_cache.empty()) {
+      if (auto stmt = module_n::load(env, options, code))
+        return stmt;
+    }
+
+    auto tokens  = token_n::process(code, *options.symbols);
     auto tree    = lisp_tree_n::process(tokens);
     auto stmt    = parse(tree, env, {type_t::stmt_program}, options);
+
+    if (!options.module_cache.empty())
+      module_n::save(static_cast<const stmt_program_t*>(stmt), options, code);
     return stmt;
   }
 
@@ -500,9 +619,9 @@ namespace aml::stmt_n {
 
     if (!check_type(tree.nodes[0], token_n::type_t::key_syscall)) return false;
 
-    for (const auto& node : tree.nodes | std::views::drop(1)) {
-      auto stmt = parse(node, env, types_expr, options);
-      args.push_back(stmt);
+    args = options.arena->array<stmt_t*>(tree.nodes.size() - 1);
+    for (size_t i{}; i < args.size(); ++i) {
+      args[i] = parse(tree.nodes[i + 1], env, types_expr, options);
     }
     return true;
   }
@@ -522,6 +641,18 @@ namespace aml::stmt_n {
 
   void stmt_syscall_t::intermediate_code(code_n::code_ctx_t& code_ctx) const {
     AML_TRACER;
+    if (auto op = dynamic_cast<stmt_int_t*>(args.front())) {
+      if (auto native = code_n::find_native(op->value, args.size() - 1)) {
+        for (const auto& arg : args | std::views::drop(1) | std::views::reverse) {
+          arg->intermediate_code(code_ctx);
+        }
+        code_ctx.code.write_cmd({native->id});
+        code_ctx.rsp -= args.size() - 1;
+        code_ctx.rsp += 1/*<return>*/;
+        return;
+      }
+    }
+
     for (const auto& arg : args | std::views::reverse) {
       arg->intermediate_code(code_ctx);
     }
@@ -531,7 +662,6 @@ namespace aml::stmt_n {
     code_ctx.code.write_cmd({code_n::cmd_id_t::syscall});
     code_ctx.rsp -= 1/*<count>*/ + args.size();
     code_ctx.rsp += 1/*<return>*/;
-    code_ctx.rsp += 1/*<rbp>*/ + 1/*<rip>*/;
   }
 
 
@@ -544,7 +674,7 @@ namespace aml::stmt_n {
     if (!check_type(tree.nodes[0], token_n::type_t::key_var)) return false;
     if (!check_type(tree.nodes[1], token_n::type_t::ident)) return false;
 
-    var = env->get_var(std::get<std::string>(tree.nodes[1].node.value));
+    var = env->get_var(std::get<token_n::symbol_t>(tree.nodes[1].node.value));
     AML_LOGGER(debug, "env:\n{}", env->show());
     return true;
   }
@@ -1,7 +1,97 @@
 #include "token.h"
 
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <sstream>
+
 namespace aml::token_n {
 
+  // character classes and transitions of the scanner used by token_t::next
+  enum class char_t : uint8_t {
+    other,
+    new_line,
+    blank,
+    semicolon,
+    lp,
+    rp,
+    quote,
+    hash,
+    sign,
+    digit,
+    word,
+    count,
+  };
+
+  enum class state_t : uint8_t {
+    start,
+    sign,
+    integer,
+    ident,
+    stop,
+    count,
+  };
+
+  static constexpr auto chars = [] {
+    std::array<char_t, 0x100> chars = {};
+    for (int c = 'a'; c <= 'z'; ++c) chars[static_cast<size_t>(c)] = char_t::word;
+    for (int c = 'A'; c <= 'Z'; ++c) chars[static_cast<size_t>(c)] = char_t::word;
+    for (int c = '0'; c <= '9'; ++c) chars[static_cast<size_t>(c)] = char_t::digit;
+    for (char c : std::string_view("_<=>&|!:*^/")) chars[static_cast<uint8_t>(c)] = char_t::word;
+    chars['+']  = char_t::sign;
+    chars['-']  = char_t::sign;
+    chars['\n'] = char_t::new_line;
+    chars[' ']  = char_t::blank;
+    chars['\t'] = char_t::blank;
+    chars[';']  = char_t::semicolon;
+    chars['(']  = char_t::lp;
+    chars[')']  = char_t::rp;
+    chars['"']  = char_t::quote;
+    chars['#']  = char_t::hash;
+    return chars;
+  }();
+
+  // integer: [-+]?\d+, ident: [-+\w<=>&|!:*^/]+, an integer followed by ident chars is an ident
+  static constexpr auto states = [] {
+    constexpr auto size = static_cast<size_t>(char_t::count);
+    std::array<std::array<state_t, size>, static_cast<size_t>(state_t::count)> states = {};
+    for (auto& row : states) row.fill(state_t::stop);
+
+    auto set = [&states](state_t from, char_t c, state_t to) {
+      states[static_cast<size_t>(from)][static_cast<size_t>(c)] = to;
+    };
+    set(state_t::start,   char_t::sign,  state_t::sign);
+    set(state_t::start,   char_t::digit, state_t::integer);
+    set(state_t::start,   char_t::word,  state_t::ident);
+    set(state_t::sign,    char_t::sign,  state_t::ident);
+    set(state_t::sign,    char_t::digit, state_t::integer);
+    set(state_t::sign,    char_t::word,  state_t::ident);
+    set(state_t::integer, char_t::sign,  state_t::ident);
+    set(state_t::integer, char_t::digit, state_t::integer);
+    set(state_t::integer, char_t::word,  state_t::ident);
+    set(state_t::ident,   char_t::sign,  state_t::ident);
+    set(state_t::ident,   char_t::digit, state_t::ident);
+    set(state_t::ident,   char_t::word,  state_t::ident);
+    return states;
+  }();
+
+  static inline char_t char_class(char c) {
+    return chars[static_cast<uint8_t>(c)];
+  }
+
+  static int64_t integer(std::string_view lexeme, const pos_t& pos) {
+    if (lexeme.front() == '+') lexeme.remove_prefix(1);
+
+    int64_t value = {};
+    auto [end, ec] = std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), value);
+    if (ec != std::errc{} || end != lexeme.data() + lexeme.size())
+      throw utils_n::fatal_error_t("token_t: invalid integer at " + pos.show());
+    return value;
+  }
+
+
+
+
   std::string pos_t::show() const {
     return std::to_string(line)
       + ":" + std::to_string(column)
@@ -10,6 +100,21 @@ namespace aml::token_n {
 
 
 
+  symbol_t symbols_t::intern(std::string_view name) {
+    if (auto it = ids.find(name); it != ids.end())
+      return {it->second, it->first};
+
+    if (names.size() >= symbol_t::npos)
+      throw utils_n::fatal_error_t("symbols_t: too many symbols");
+
+    auto id = static_cast<uint32_t>(names.size());
+    std::string_view name_new = names.emplace_back(name);
+    ids.emplace(name_new, id);
+    return {id, name_new};
+  }
+
+
+
   bool token_t::is_primary() const {
     switch (type) {
       case type_t::unknown:
@@ -46,61 +151,119 @@ namespace aml::token_n {
       }
       case type_t::ident:
       {
-        const auto* p = std::get_if<std::string>(&value);
-        return p ? *p : "<ident>";
+        const auto* p = std::get_if<symbol_t>(&value);
+        return p ? std::string(p->name) : "<ident>";
       }
       case type_t::dq_string:
       {
-        const auto* p = std::get_if<std::string>(&value);
-        return p ? ('"' + *p + '"') : "<dq_string>";
+        const auto* p = std::get_if<std::string_view>(&value);
+        return p ? ('"' + std::string(*p) + '"') : "<dq_string>";
       }
       case type_t::eof:         return "\0";
       default:                  return "(unknown)";
     }
   }
 
-  bool token_t::next(std::string::const_iterator& it, std::string::const_iterator ite) {
+  bool token_t::next(std::string::const_iterator& it, std::string::const_iterator ite, symbols_t& symbols) {
     if (it == ite) {
       pos.column += pos.length;
       pos.length  = 0;
-      lexeme      = "\0";
+      lexeme      = {};
       value       = {};
       type        = type_t::eof;
       return false;
     }
 
-    std::smatch m;
-    std::regex_constants::match_flag_type flags =
-      std::regex_constants::match_continuous | std::regex_constants::match_not_null;
-
-    const rule_t* match_rule = nullptr;
-    std::smatch match_best;
+    auto begin = it;
+    type_t match = type_t::unknown;
 
-    for (const auto& rule : rules) {
-      if (!std::regex_search(it, ite, m, rule.regex, flags))
-        continue;
-
-      if (m.position())
-        throw utils_n::fatal_error_t("token_t: unknown position at " + pos.show());
-
-      if (m.length() > (!match_best.empty() ? match_best.length() : 0)) {
-        match_best = m;
-        match_rule = &rule;
+    switch (char_class(*it)) {
+      case char_t::new_line:
+      {
+        ++it;
+        match = type_t::new_line;
+        break;
       }
-    }
+      case char_t::blank:
+      {
+        while (it != ite && char_class(*it) == char_t::blank) ++it;
+        match = type_t::whitespace;
+        break;
+      }
+      case char_t::semicolon:
+      {
+        while (it != ite && *it != '\n') ++it;
+        match = type_t::whitespace;
+        break;
+      }
+      case char_t::lp:
+      {
+        ++it;
+        match = type_t::lp;
+        break;
+      }
+      case char_t::rp:
+      {
+        ++it;
+        match = type_t::rp;
+        break;
+      }
+      case char_t::quote:
+      {
+        auto end = std::find_if(it + 1, ite, [](char c) { return c == '"' || c == '\n' || c == '\r'; });
+        if (end == ite || *end != '"') return false;
+        it = end + 1;
+        match = type_t::dq_string;
+        break;
+      }
+      case char_t::hash:
+      {
+        auto keyword = token_t{.type = type_t::key_include}.show();
+        if (!std::string_view(&*it, static_cast<size_t>(ite - it)).starts_with(keyword)) return false;
+        it += static_cast<std::ptrdiff_t>(keyword.size());
+        match = type_t::key_include;
+        break;
+      }
+      case char_t::sign:
+      case char_t::digit:
+      case char_t::word:
+      {
+        auto state = state_t::start;
+        for (; it != ite; ++it) {
+          auto state_next = states[static_cast<size_t>(state)][static_cast<size_t>(char_class(*it))];
+          if (state_next == state_t::stop) break;
+          state = state_next;
+        }
 
-    if (!match_rule) {
-      return false;
+        match = state == state_t::integer ? type_t::integer : type_t::ident;
+        if (match == type_t::ident) {
+          std::string_view word(&*begin, static_cast<size_t>(it - begin));
+          auto keyword = std::find_if(keywords.begin(), keywords.end(),
+              [word](const auto& keyword) { return keyword.first == word; });
+          if (keyword != keywords.end())
+            match = keyword->second;
+        }
+        break;
+      }
+      default:
+      {
+        return false;
+      }
     }
 
-    it         += match_best.length();
     pos.column += pos.length;
-    pos.length  = match_best.length();
-    lexeme      = match_best.str();
-    value       = match_rule->get_value(lexeme);
-    type        = match_rule->type;
+    pos.length  = static_cast<uint32_t>(it - begin);
+    lexeme      = std::string_view(&*begin, pos.length);
+    type        = match;
+
+    switch (type) {
+      case type_t::integer:   value = integer(lexeme, pos);                break;
+      case type_t::ident:     value = symbols.intern(lexeme);              break;
+      case type_t::dq_string: value = lexeme.substr(1, lexeme.size() - 2); break;
+      default:                value = {};                                  break;
+    }
 
-    if (match_rule->type == type_t::new_line) {
+    if (type == type_t::new_line) {
       pos.line++;
       pos.length = 0;
       pos.column = utils_n::column_start;
@@ -121,13 +284,14 @@ namespace aml::token_n {
     return ss.str();
   }
 
-  tokens_t process(const std::string& code) {
+  tokens_t process(const std::string& code, symbols_t& symbols) {
     tokens_t tokens;
+    tokens.reserve(code.size() / 4);
     token_t token;
     auto it = code.begin();
     auto ite = code.end();
 
-    while (token.next(it, ite)) {
+    while (token.next(it, ite, symbols)) {
       if (token.is_primary())
         tokens.push_back(token);
     }
@@ -1,8 +1,17 @@
 #define CATCH_CONFIG_MAIN
 #include "catch2/catch.hpp"
 #include "aml.h"
+#include "array.h"
+#include "batch.h"
+#include "scheduler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <map>
+#include <random>
+#include <thread>
 
 
 #define AML_TEST(name, expected, code) \
@@ -212,6 +221,1064 @@ AML_TEST("var5", "12",
 
 
 
+AML_TEST("var after if", "7",
+  R"AML(
+    (defn test
+      (block
+        (if
+          (int 1)
+          (int 2)
+          (int 3))
+        (defvar a
+          (int 7))
+        (var a)))
+    (call
+      (func test))
+  )AML")
+
+AML_TEST("var after syscall", "7",
+  R"AML(
+    (defn test
+      (block
+        (syscall
+          (int 200)
+          (int 1)
+          (int 2))
+        (defvar a
+          (int 7))
+        (var a)))
+    (call
+      (func test))
+  )AML")
+
+
+
+AML_TEST("recursion", "120",
+  R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn product
+      (if
+        (call
+          (func >)
+          (arg 1)
+          (int 1))
+        (call
+          (func *)
+          (arg 1)
+          (call
+            (func product)
+            (call
+              (func -)
+              (arg 1)
+              (int 1))))
+        (int 1)))
+    (call
+      (func product)
+      (int 5))
+  )AML")
+
+
+
+AML_TEST("deep recursion", "5000",
+  R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn count
+      (if
+        (call
+          (func <)
+          (arg 1)
+          (int 1))
+        (int 0)
+        (call
+          (func +)
+          (int 1)
+          (call
+            (func count)
+            (call
+              (func -)
+              (arg 1)
+              (int 1))))))
+    (call
+      (func count)
+      (int 5000))
+  )AML")
+
+#define AML_TEST_OP(name, expected, op, a, b) \
+AML_TEST(name, expected, \
+  "(#include \"aml/standard/standard.aml\")" \
+  "(call (func " op ") (int " a ") (int " b "))")
+
+AML_TEST_OP("op +",    "13",  "+",  "10", "3")
+AML_TEST_OP("op -",    "7",   "-",  "10", "3")
+AML_TEST_OP("op *",    "-30", "*",  "10", "-3")
+AML_TEST_OP("op /",    "3",   "/",  "10", "3")
+AML_TEST_OP("op / 0",  "0",   "/",  "10", "0")
+AML_TEST_OP("op ==",   "1",   "==", "3",  "3")
+AML_TEST_OP("op <",    "0",   "<",  "10", "3")
+AML_TEST_OP("op >",    "1",   ">",  "10", "3")
+AML_TEST_OP("op !=",   "1",   "!=", "10", "3")
+AML_TEST_OP("op &&",   "0",   "&&", "1",  "0")
+AML_TEST_OP("op ||",   "1",   "||", "1",  "0")
+
+AML_TEST("op !", "1",
+  R"AML(
+    (#include "aml/standard/standard.aml")
+    (call
+      (func !)
+      (int 0))
+  )AML")
+
+AML_TEST("syscall dynamic op", "7",
+  R"AML(
+    (defn test
+      (syscall
+        (arg 1)
+        (int 10)
+        (int 3)))
+    (call
+      (func test)
+      (int 201))
+  )AML")
+
+
+
+AML_TEST("tail recursion", "20000",
+  R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn count
+      (if
+        (call
+          (func <)
+          (arg 1)
+          (int 1))
+        (arg 2)
+        (block
+          (defvar next
+            (call
+              (func -)
+              (arg 1)
+              (int 1)))
+          (call
+            (func count)
+            (var next)
+            (call
+              (func +)
+              (arg 2)
+              (int 1))))))
+    (call
+      (func count)
+      (int 20000)
+      (int 0))
+  )AML")
+
+AML_TEST("inline locals", "43",
+  R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn square_inc
+      (block
+        (defvar a
+          (call
+            (func *)
+            (arg 1)
+            (arg 1)))
+        (call
+          (func +)
+          (var a)
+          (int 1))))
+    (call
+      (func +)
+      (call
+        (func square_inc)
+        (call
+          (func +)
+          (int 2)
+          (int 3)))
+      (call
+        (func square_inc)
+        (int 4)))
+  )AML")
+
+TEST_CASE("inline") {
+  using namespace aml::aml_n;
+  auto code = R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn square
+      (call
+        (func *)
+        (arg 1)
+        (arg 1)))
+    (defn count
+      (if
+        (call
+          (func <)
+          (arg 1)
+          (int 1))
+        (int 0)
+        (call
+          (func +)
+          (call
+            (func square)
+            (arg 1))
+          (call
+            (func count)
+            (call
+              (func -)
+              (arg 1)
+              (int 1))))))
+    (call
+      (func count)
+      (call
+        (func square)
+        (int 3)))
+  )AML";
+
+  for (size_t inline_threshold : {0, 16}) {
+    options_t options = {
+      .input            = code,
+      .cmd              = "compile",
+      .inline_threshold = inline_threshold,
+    };
+    REQUIRE(run(options));
+    REQUIRE((options.inlined != 0) == (inline_threshold != 0));
+
+    options.input  = std::move(options.output);
+    options.output = {};
+    options.cmd    = "execute";
+    REQUIRE(run(options));
+    REQUIRE(options.output == "285");
+  }
+}
+
+TEST_CASE("nested if") {
+  using namespace aml::aml_n;
+  std::string code = "(int 200)";
+  for (size_t i = 200; i-- > 0; ) {
+    code = "(if (syscall (int 204) (arg 1) (int " + std::to_string(i) + ")) (int " + std::to_string(i) + ") " + code + ")";
+  }
+
+  options_t options = {
+    .input = "(defn test " + code + ") (call (func test) (int 150))",
+    .cmd   = "compile",
+  };
+  REQUIRE(run(options));
+
+  options.input  = std::move(options.output);
+  options.output = {};
+  options.cmd    = "execute";
+  REQUIRE(run(options));
+  REQUIRE(options.output == "150");
+}
+
+AML_TEST("scope shadowing", "21",
+  R"AML(
+    (defn test
+      (block
+        (defvar x (int 1))
+        (defvar y
+          (block
+            (defvar x (int 10))
+            (syscall (int 200) (var x) (var x))))
+        (syscall (int 200) (var x) (var y))))
+    (call
+      (func test))
+  )AML")
+
+TEST_CASE("fold") {
+  using namespace aml::aml_n;
+  auto code = R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn test
+      (block
+        (int 7)
+        (if
+          (call
+            (func <)
+            (call (func +) (int 2) (int 3))
+            (syscall (int 202) (int 2) (int 4)))
+          (call
+            (func +)
+            (call (func /) (arg 1) (int 0))
+            (call (func /) (int 50) (int 0)))
+          (arg 1))))
+    (call
+      (func test)
+      (int 40))
+  )AML";
+
+  std::string output_plain;
+  for (bool fold : {false, true}) {
+    options_t options = {
+      .input = code,
+      .cmd   = "compile",
+      .fold  = fold,
+    };
+    REQUIRE(run(options));
+    REQUIRE((options.folded != 0) == fold);
+    if (fold) {
+      // +, *, <, if, /, the block value and the block itself
+      REQUIRE(options.folded == 7);
+      REQUIRE(options.output.size() < output_plain.size());
+    }
+    output_plain = options.output;
+
+    options.input  = std::move(options.output);
+    options.output = {};
+    options.cmd    = "execute";
+    REQUIRE(run(options));
+    REQUIRE(options.output == "0");
+  }
+
+  // overflowing literals fold to what the vm computes: max * 2 + min / -1 wraps around to max - 1
+  auto code_overflow = R"AML(
+    (#include "aml/standard/standard.aml")
+    (call (func +)
+      (call (func *) (int 9223372036854775807) (int 2))
+      (call (func /) (call (func -) (int -9223372036854775807) (int 1)) (int -1)))
+  )AML";
+  for (bool fold : {false, true}) {
+    options_t options = {
+      .input = code_overflow,
+      .cmd   = "compile",
+      .fold  = fold,
+    };
+    REQUIRE(run(options));
+    REQUIRE((options.folded != 0) == fold);
+    options.input  = std::move(options.output);
+    options.output = {};
+    options.cmd    = "execute";
+    REQUIRE(run(options));
+    REQUIRE(options.output == "9223372036854775806");
+  }
+}
+
+TEST_CASE("scope errors") {
+  using namespace aml::aml_n;
+  for (auto [code, error] : std::vector<std::pair<std::string, std::string>>{
+      {"(defn test (block (block (defvar x (int 1))) (var x))) (call (func test))", "'x' is not exists"},
+      {"(defn test (block (defvar x (int 1)) (defvar x (int 2)))) (call (func test))", "'x' is exists"},
+      {"(defn test (int 1)) (defn test (int 2)) (call (func test))", "'test' is exists"}}) {
+    options_t options = {
+      .input = code,
+      .cmd   = "compile",
+    };
+    INFO("code: " << code);
+    REQUIRE(!run(options));
+    REQUIRE(options.errors.find(error) != std::string::npos);
+  }
+}
+
+TEST_CASE("module cache") {
+  using namespace aml::aml_n;
+  auto module_cache = std::filesystem::temp_directory_path() / "aml_tests_module_cache";
+  std::filesystem::remove_all(module_cache);
+
+  auto compile = [&]() {
+    options_t options = {
+      .input        = "(#include \"aml/standard/standard.aml\") (call (func *) (int 6) (int 7))",
+      .cmd          = "compile",
+      .module_cache = module_cache.string(),
+    };
+    INFO("errors: " << options.errors);
+    REQUIRE(run(options));
+    return options.output;
+  };
+
+  // a module per file of the standard library
+  auto output = compile();
+  REQUIRE(std::distance(std::filesystem::directory_iterator(module_cache), std::filesystem::directory_iterator{}) == 6);
+  REQUIRE(compile() == output);
+
+  // corrupted modules are parsed again and rewritten
+  for (const auto& entry : std::filesystem::directory_iterator(module_cache))
+    std::ofstream(entry.path()) << "AMLM garbage";
+  REQUIRE(compile() == output);
+  REQUIRE(compile() == output);
+
+  std::filesystem::remove_all(module_cache);
+}
+
+TEST_CASE("parallel codegen") {
+  using namespace aml::aml_n;
+  // f_i(x) = f_(i-1)(x) + 1, the output must not depend on the number of threads
+  std::string code = "(#include \"aml/standard/standard.aml\") (defn f_0 (arg 1))\n";
+  for (size_t i = 1; i < 500; ++i)
+    code += "(defn f_" + std::to_string(i) + " (call (func +) (call (func f_" + std::to_string(i - 1) + ") (arg 1)) (int 1)))\n";
+  code += "(call (func f_499) (int 1))";
+
+  std::string output;
+  for (size_t jobs : {1, 4}) {
+    options_t options = {
+      .input = code,
+      .cmd   = "compile",
+      .jobs  = jobs,
+    };
+    INFO("errors: " << options.errors);
+    REQUIRE(run(options));
+    if (output.empty())
+      output = options.output;
+    REQUIRE(options.output == output);
+  }
+
+  options_t options = {
+    .input = output,
+    .cmd   = "execute",
+  };
+  REQUIRE(run(options));
+  REQUIRE(options.output == "500");
+}
+
+TEST_CASE("image") {
+  using namespace aml::aml_n;
+  options_t options = {
+    .input = "(#include \"aml/standard/standard.aml\") (defn test (call (func *) (arg 1) (int 3))) (call (func test) (int 14))",
+    .cmd   = "compile",
+  };
+  REQUIRE(run(options));
+  auto image_str = options.output;
+  REQUIRE(image_str.starts_with(aml::image_n::magic));
+
+  auto image = aml::image_n::image_t::view(image_str);
+  auto labels = image->labels();
+  REQUIRE(std::find_if(labels.begin(), labels.end(), [](const auto& label) { return label.name == "test"; }) != labels.end());
+
+  // mapped from a file
+  auto filename = std::filesystem::temp_directory_path() / "aml_tests_image.amlb";
+  aml::utils_n::str_to_file(image_str, filename);
+  options = {
+    .file_input = filename,
+    .cmd        = "execute",
+  };
+  REQUIRE(run(options));
+  REQUIRE(options.output == "42");
+  std::filesystem::remove(filename);
+
+  // legacy layout without the header
+  aml::code_n::code_ctx_t code_ctx;
+  code_ctx.code.buffer.assign(image->code().begin(), image->code().end());
+  code_ctx.rip = image->entry();
+  options = {
+    .input = code_ctx.save(),
+    .cmd   = "execute",
+  };
+  REQUIRE(run(options));
+  REQUIRE(options.output == "42");
+}
+
+TEST_CASE("encoding") {
+  using namespace aml::aml_n;
+  // recursion, jumps both ways, natives and operands wider than an aligned word
+  auto code = R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn fib
+      (if
+        (call (func <) (arg 1) (int 2))
+        (arg 1)
+        (call (func +)
+          (call (func fib) (call (func -) (arg 1) (int 1)))
+          (call (func fib) (call (func -) (arg 1) (int 2))))))
+    (defn wide
+      (syscall (int 201) (arg 1) (int -123456789012)))
+    (call (func +) (call (func fib) (int 15)) (call (func wide) (int 5000000000)))
+  )AML";
+
+  std::map<std::string, size_t> sizes;
+  for (std::string encoding : {"packed", "aligned"}) {
+    options_t options = {
+      .input    = code,
+      .cmd      = "compile",
+      .encoding = encoding,
+      .fold     = false,
+    };
+    INFO("encoding: " << encoding << " errors: " << options.errors);
+    REQUIRE(run(options));
+    sizes[encoding] = options.output.size();
+    REQUIRE(aml::image_n::image_t::view(options.output)->encoding()
+        == (encoding == "aligned" ? aml::code_n::encoding_t::aligned : aml::code_n::encoding_t::packed));
+
+    options.input  = std::move(options.output);
+    options.output = {};
+    options.cmd    = "execute";
+    REQUIRE(run(options));
+    REQUIRE(options.output == std::to_string(610 + 5000000000 + 123456789012));
+  }
+  REQUIRE(sizes["packed"] < sizes["aligned"]);
+
+  options_t options = {
+    .input    = code,
+    .cmd      = "compile",
+    .encoding = "wide",
+  };
+  REQUIRE(!run(options));
+}
+
+TEST_CASE("profile") {
+  using namespace aml::aml_n;
+  auto code = R"AML(
+    (#include "aml/standard/standard.aml")
+    (defn fib
+      (if
+        (call (func <) (arg 1) (int 2))
+        (arg 1)
+        (call (func +)
+          (call (func fib) (call (func -) (arg 1) (int 1)))
+          (call (func fib) (call (func -) (arg 1) (int 2))))))
+    (call (func fib) (int 10))
+  )AML";
+
+  options_t options = {
+    .input            = code,
+    .cmd              = "compile",
+    .inline_threshold = 0,
+  };
+  REQUIRE(run(options));
+
+  // the profile of the executor itself, run would print its report to stderr
+  aml::profile_n::profile_t profile;
+  auto image = aml::image_n::image_t::view(options.output);
+  REQUIRE(executor_n::process(*image, aml::code_n::stack_t::capacity_default,
+        aml::array_n::heap_t::capacity_default, executor_n::budget_default, &profile) == "55");
+  REQUIRE(profile.report().find("instructions:") != std::string::npos);
+
+  // fib(10) makes 177 calls, the collapsed stacks sum up to all executed instructions
+  auto fib = std::find_if(profile.funcs.begin(), profile.funcs.end(), [](const auto& func) { return func.name == "fib"; });
+  REQUIRE(fib != profile.funcs.end());
+  REQUIRE(fib->calls == 177);
+  REQUIRE(profile.funcs.front().inclusive == profile.total);
+  REQUIRE(profile.max_depth == 11);
+
+  size_t total = {};
+  std::stringstream collapsed(profile.collapsed());
+  for (std::string line; std::getline(collapsed, line); )
+    total += std::stoull(line.substr(line.rfind(' ') + 1));
+  REQUIRE(total == profile.total);
+}
+
+
+
+TEST_CASE("program") {
+  using namespace aml::aml_n;
+  // a rule of two inputs, compiled once and executed with different args
+  options_t options = {
+    .input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn fact
+        (if (call (func <) (arg 1) (int 2))
+          (int 1)
+          (call (func *) (arg 1) (call (func fact) (call (func -) (arg 1) (int 1))))))
+      (call (func +) (call (func fact) (arg 1)) (arg 2))
+    )AML",
+  };
+  auto program = compile_program(options);
+  INFO("errors: " << options.errors);
+  REQUIRE(program);
+
+  aml::code_n::stack_t stack(256);
+  for (int64_t n : {1, 5, 10}) {
+    std::vector<int64_t> args = {n, 1000};
+    int64_t fact = 1;
+    for (int64_t i = 2; i <= n; ++i)
+      fact *= i;
+    auto result = execute(*program, args, stack);
+    REQUIRE(result);
+    REQUIRE(result.value == fact + 1000);
+  }
+
+  auto overflow = execute(*program, std::vector<int64_t>{1000, 0}, stack);
+  REQUIRE(overflow.status == status_t::error);
+  auto suspended = execute(*program, std::vector<int64_t>{10, 0}, stack, 10);
+  REQUIRE(suspended.status == status_t::suspended);
+  REQUIRE(execute(*program, std::vector<int64_t>{3, 4}).value == 10);
+
+  // the same program loaded back from its image
+  options_t options_compile = {.input = options.input, .cmd = "compile"};
+  REQUIRE(run(options_compile));
+  options_t options_load = {.input = options_compile.output};
+  auto loaded = load_program(options_load);
+  REQUIRE(loaded);
+  REQUIRE(execute(*loaded, std::vector<int64_t>{4, 2}).value == 26);
+
+  options_t options_error = {.input = "(call (func unknown) (int 1))"};
+  REQUIRE(!compile_program(options_error));
+  REQUIRE(!options_error.errors.empty());
+}
+
+
+
+TEST_CASE("overflow") {
+  using namespace aml::aml_n;
+  // the args are not constants, the native cmds compute at run time and wrap around
+  auto eval = [](const std::string& op, int64_t a, int64_t b) {
+    options_t options = {.input = R"AML(
+        (#include "aml/standard/standard.aml")
+        (call (func )AML" + op + R"AML() (arg 1) (arg 2))
+      )AML"};
+    auto program = compile_program(options);
+    REQUIRE(program);
+    auto result = execute(*program, std::vector<int64_t>{a, b});
+    REQUIRE(result);
+    return result.value;
+  };
+  const auto min = std::numeric_limits<int64_t>::min();
+  const auto max = std::numeric_limits<int64_t>::max();
+  REQUIRE(eval("+", max, 1) == min);
+  REQUIRE(eval("-", min, 1) == max);
+  REQUIRE(eval("*", max, 2) == -2);
+  REQUIRE(eval("/", min, -1) == min);
+  REQUIRE(eval("/", 7, -1) == -7);
+  REQUIRE(eval("/", 7, 0) == 0);
+}
+
+
+
+TEST_CASE("fuel") {
+  using namespace aml::aml_n;
+  options_t options = {
+    .input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn fib
+        (if (call (func <) (arg 1) (int 2))
+          (arg 1)
+          (call (func +) (call (func fib) (call (func -) (arg 1) (int 1))) (call (func fib) (call (func -) (arg 1) (int 2))))))
+      (call (func fib) (arg 1))
+    )AML",
+  };
+  auto program = compile_program(options);
+  REQUIRE(program);
+
+  // tenants time-sliced by one thread, each resumed with the same fuel until it completes
+  std::vector<aml::code_n::stack_t> stacks(8);
+  std::vector<result_t> results(stacks.size());
+  for (size_t i{}; i < stacks.size(); ++i) {
+    std::vector<int64_t> args = {static_cast<int64_t>(i + 8)};
+    results[i] = execute(*program, args, stacks[i], 100);
+  }
+  for (size_t slices{}; std::any_of(results.begin(), results.end(),
+        [](const auto& result) { return result.status == status_t::suspended; }); ++slices) {
+    REQUIRE(slices < 100000);
+    for (size_t i{}; i < stacks.size(); ++i) {
+      if (results[i].status == status_t::suspended)
+        results[i] = resume(*program, stacks[i], 100);
+    }
+  }
+  int64_t fib[] = {21, 34, 55, 89, 144, 233, 377, 610};
+  for (size_t i{}; i < results.size(); ++i) {
+    REQUIRE(results[i]);
+    REQUIRE(results[i].value == fib[i]);
+  }
+  REQUIRE(resume(*program, stacks[0], 100).status == status_t::error);
+
+  // the cli fails a program past its budget instead of printing what is left on the stack
+  options_t options_compile = {.input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn fib
+        (if (call (func <) (arg 1) (int 2))
+          (arg 1)
+          (call (func +) (call (func fib) (call (func -) (arg 1) (int 1))) (call (func fib) (call (func -) (arg 1) (int 2))))))
+      (call (func fib) (int 15))
+    )AML", .cmd = "compile"};
+  REQUIRE(run(options_compile));
+  options_t options_execute = {.input = options_compile.output, .cmd = "execute", .budget = 100};
+  REQUIRE(!run(options_execute));
+  REQUIRE(options_execute.errors.find("budget") != std::string::npos);
+  options_execute.budget = executor_n::budget_default;
+  REQUIRE(run(options_execute));
+  REQUIRE(options_execute.output == "610");
+}
+
+
+
+TEST_CASE("scheduler") {
+  using namespace aml::aml_n;
+  // a task yields in every iteration of its loop, a long one runs without yields
+  options_t options_loop = {
+    .input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn loop
+        (if (call (func <) (arg 1) (int 1))
+          (arg 2)
+          (call (func loop) (call (func -) (arg 1) (int 1)) (call (func yield) (call (func +) (arg 2) (int 1))))))
+      (call (func loop) (arg 1) (int 0))
+    )AML",
+  };
+  auto loop = compile_program(options_loop);
+  REQUIRE(loop);
+  options_t options_spin = {
+    .input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn spin
+        (if (call (func <) (arg 1) (int 1))
+          (int -1)
+          (call (func spin) (call (func -) (arg 1) (int 1)))))
+      (call (func spin) (arg 1))
+    )AML",
+  };
+  auto spin = compile_program(options_spin);
+  REQUIRE(spin);
+
+  std::map<size_t, result_t> results;
+  std::vector<size_t> order;
+  aml::scheduler_n::scheduler_t scheduler({.slice = 100, .stack_capacity = 256, .budget = 100000},
+      [&](size_t id, const result_t& result) { results[id] = result; order.push_back(id); });
+
+  std::vector<size_t> loops;
+  for (int64_t i = 1; i <= 100; ++i)
+    loops.push_back(scheduler.spawn(loop, std::vector<int64_t>{i}));
+  auto spin_id     = scheduler.spawn(spin, std::vector<int64_t>{1000});
+  auto overflow_id = scheduler.spawn(loop, std::vector<int64_t>{1000000});
+  scheduler.run();
+
+  REQUIRE(results.size() == 102);
+  for (size_t i{}; i < loops.size(); ++i) {
+    REQUIRE(results[loops[i]]);
+    REQUIRE(results[loops[i]].value == static_cast<int64_t>(i + 1));
+  }
+  REQUIRE(results[spin_id].value == -1);
+  REQUIRE(results[overflow_id].status == status_t::error);
+  REQUIRE(scheduler.counters.completed == 101);
+  REQUIRE(scheduler.counters.failed == 1);
+  REQUIRE(scheduler.counters.yields >= 5050);
+  REQUIRE(scheduler.counters.slices > scheduler.counters.yields);
+  REQUIRE(scheduler.tasks.size() == 102);
+  REQUIRE(order.front() == loops.front());
+
+  // a task of a higher priority runs first, its stack is reused from a finished task
+  aml::scheduler_n::scheduler_t priority({.policy = aml::scheduler_n::policy_t::priority, .slice = 10},
+      [&](size_t id, const result_t&) { order.push_back(id); });
+  order.clear();
+  auto low  = priority.spawn(loop, std::vector<int64_t>{5}, 0);
+  auto high = priority.spawn(loop, std::vector<int64_t>{5}, 1);
+  priority.run();
+  REQUIRE(order == std::vector<size_t>{high, low});
+  priority.spawn(loop, std::vector<int64_t>{5});
+  priority.run();
+  REQUIRE(priority.tasks.size() == 2);
+}
+
+
+
+TEST_CASE("memoize") {
+  using namespace aml::aml_n;
+  using aml::code_n::cmd_id_t;
+  auto code = R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn fib
+        (if (call (func <) (arg 1) (int 2))
+          (arg 1)
+          (call (func +) (call (func fib) (call (func -) (arg 1) (int 1))) (call (func fib) (call (func -) (arg 1) (int 2))))))
+      (defn spin
+        (if (call (func <) (arg 1) (int 1))
+          (int 0)
+          (call (func spin) (call (func -) (call (func yield) (arg 1)) (int 1)))))
+      (defn main
+        (if (call (func <) (arg 1) (int 0))
+          (call (func spin) (int 3))
+          (call (func fib) (arg 1))))
+      (call (func main) (arg 1))
+    )AML";
+  auto memos = [](const program_t& program) {
+    return std::count_if(program.code.cmds.begin(), program.code.cmds.end(),
+        [](const auto& cmd) { return cmd.id == cmd_id_t::memo; });
+  };
+
+  options_t options = {.input = code};
+  auto program = compile_program(options);
+  REQUIRE(program);
+  REQUIRE(memos(*program) == 0);
+
+  // fib is cached, spin yields and the defns of the standard library call no defns
+  options_t options_memoize = {.input = code, .memoize = true};
+  auto memoized = compile_program(options_memoize);
+  REQUIRE(memoized);
+  REQUIRE(memos(*memoized) == 1);
+  REQUIRE(options_memoize.pure > 0);
+
+  aml::code_n::stack_t stack(1024);
+  auto plain  = execute(*program, std::vector<int64_t>{20}, stack);
+  auto cached = execute(*memoized, std::vector<int64_t>{20}, stack);
+  REQUIRE(plain.value == 6765);
+  REQUIRE(cached.value == 6765);
+  REQUIRE(cached.cmds * 20 < plain.cmds);
+  REQUIRE(stack.memo.hits > 0);
+  REQUIRE(execute(*memoized, std::vector<int64_t>{80}, stack).value == 23416728348467685);
+
+  // without inlining the body of fib ends in a call of +, it is not a tail call or memo_ret would be skipped
+  options_t options_call = {.input = code, .inline_threshold = 0};
+  auto called = compile_program(options_call);
+  options_t options_call_memoize = {.input = code, .inline_threshold = 0, .memoize = true};
+  auto called_memoized = compile_program(options_call_memoize);
+  REQUIRE(called);
+  REQUIRE(called_memoized);
+  auto plain_call  = execute(*called, std::vector<int64_t>{20}, stack);
+  auto cached_call = execute(*called_memoized, std::vector<int64_t>{20}, stack);
+  REQUIRE(plain_call.value == 6765);
+  REQUIRE(cached_call.value == 6765);
+  REQUIRE(stack.memo.hits > 0);
+  REQUIRE(cached_call.cmds * 20 < plain_call.cmds);
+
+  // the memo operands survive both encodings
+  for (auto encoding : {"packed", "aligned"}) {
+    options_t options_compile = {.input = code, .cmd = "compile", .encoding = encoding, .memoize = true};
+    REQUIRE(run(options_compile));
+    options_t options_load = {.input = options_compile.output};
+    auto loaded = load_program(options_load);
+    REQUIRE(loaded);
+    REQUIRE(memos(*loaded) == 1);
+    REQUIRE(execute(*loaded, std::vector<int64_t>{30}).value == 832040);
+  }
+}
+
+
+
+TEST_CASE("array kernels") {
+  using namespace aml::array_n;
+  // every isa of the cpu against the scalar kernels, the lengths cover the tails of the vector loops
+  std::mt19937_64 random(42);
+  const auto& scalar = kernels(isa_t::scalar);
+  for (auto isa : {isa_t::sse, isa_t::avx2}) {
+    if (!supported(isa))
+      continue;
+    INFO("isa: " << show(isa));
+    const auto& simd = kernels(isa);
+    for (size_t n{}; n < 40; ++n) {
+      std::vector<int64_t> a(n);
+      std::vector<int64_t> b(n);
+      for (size_t i{}; i < n; ++i) {
+        a[i] = static_cast<int64_t>(random());
+        b[i] = i % 3 ? static_cast<int64_t>(random() % 1000) - 500 : std::numeric_limits<int64_t>::min();
+      }
+      REQUIRE(simd.sum(a.data(), n) == scalar.sum(a.data(), n));
+      REQUIRE(simd.min(b.data(), n) == scalar.min(b.data(), n));
+      REQUIRE(simd.max(a.data(), n) == scalar.max(a.data(), n));
+      REQUIRE(simd.dot(a.data(), b.data(), n) == scalar.dot(a.data(), b.data(), n));
+
+      std::vector<int64_t> expected(n);
+      std::vector<int64_t> actual(n);
+      scalar.mul(expected.data(), a.data(), b.data(), n);
+      simd.mul(actual.data(), a.data(), b.data(), n);
+      REQUIRE(actual == expected);
+      scalar.add(expected.data(), a.data(), b.data(), n);
+      simd.add(actual.data(), a.data(), b.data(), n);
+      REQUIRE(actual == expected);
+      scalar.prefix_sum(expected.data(), n);
+      simd.prefix_sum(actual.data(), n);
+      REQUIRE(actual == expected);
+    }
+  }
+}
+
+
+
+TEST_CASE("array") {
+  using namespace aml::aml_n;
+  // a[i] = 7 * i - 50, filled by the script, then a bulk expression over (var a)
+  auto code = [](const std::string& expr) {
+    return R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn fill
+        (if (call (func <) (arg 2) (call (func array_size) (arg 1)))
+          (block
+            (call (func array_set) (arg 1) (arg 2) (call (func -) (call (func *) (arg 2) (int 7)) (int 50)))
+            (call (func fill) (arg 1) (call (func +) (arg 2) (int 1))))
+          (arg 1)))
+      (defn main
+        (block
+          (defvar a (call (func fill) (call (func array) (arg 1)) (int 0)))
+          )AML" + expr + R"AML())
+      (call (func main) (arg 1))
+    )AML";
+  };
+  auto eval = [&](const std::string& expr, int64_t n = 100) {
+    options_t options = {.input = code(expr), .memoize = true};
+    auto program = compile_program(options);
+    INFO("errors: " << options.errors);
+    REQUIRE(program);
+    return execute(*program, std::vector<int64_t>{n});
+  };
+
+  std::vector<int64_t> a(100);
+  for (size_t i{}; i < a.size(); ++i)
+    a[i] = 7 * static_cast<int64_t>(i) - 50;
+  int64_t dot = {};
+  std::vector<int64_t> squares;
+  for (auto x : a) {
+    dot += x * x;
+    squares.push_back(2 * x * x);
+  }
+  std::sort(squares.begin(), squares.end());
+
+  REQUIRE(eval("(call (func array_sum) (var a))").value == 29650);
+  REQUIRE(eval("(call (func array_min) (var a))").value == -50);
+  REQUIRE(eval("(call (func array_max) (var a))").value == 643);
+  REQUIRE(eval("(call (func array_get) (var a) (int 10))").value == 20);
+  REQUIRE(eval("(call (func array_dot) (var a) (var a))").value == dot);
+  REQUIRE(eval("(call (func array_get) (call (func array_prefix_sum) (var a)) (int 99))").value == 29650);
+  REQUIRE(eval("(call (func array_get) (call (func array_sort) (call (func array_mul) (var a) "
+        "(call (func array_add) (var a) (var a)))) (int 0))").value == squares.front());
+  REQUIRE(eval("(call (func array_max) (var a))", 0).value == 0);
+
+  // an index out of range, a handle of no array and arrays of different sizes fail the execution
+  auto invalid = eval("(call (func array_get) (var a) (int 100))");
+  REQUIRE(invalid.status == status_t::error);
+  REQUIRE(invalid.error.find("index 100") != std::string::npos);
+  REQUIRE(eval("(call (func array_dot) (var a) (call (func array) (int 3)))").error.find("sizes") != std::string::npos);
+  REQUIRE(eval("(call (func array_size) (call (func array) (int 100000000)))").error.find("capacity") != std::string::npos);
+  REQUIRE(eval("(call (func array_size) (int 7))").error.find("handle") != std::string::npos);
+
+  // bulk syscalls are charged a cmd per 8 elements, a run in debt suspends until its fuel has paid it off
+  options_t options_bulk = {.input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (call (func array_sum) (call (func array) (arg 1)))
+    )AML"};
+  auto bulk = compile_program(options_bulk);
+  REQUIRE(bulk);
+  aml::code_n::stack_t stack(1024, 100000);
+  auto full = execute(*bulk, std::vector<int64_t>{80000}, stack);
+  REQUIRE(full);
+  REQUIRE(full.cmds > 20000);
+  auto sliced = execute(*bulk, std::vector<int64_t>{80000}, stack, 1000);
+  size_t cmds = sliced.cmds;
+  size_t slices = 1;
+  for (; sliced.status == status_t::suspended; ++slices) {
+    REQUIRE(sliced.cmds <= 1000);
+    sliced = resume(*bulk, stack, 1000);
+    cmds += sliced.cmds;
+  }
+  REQUIRE(sliced);
+  REQUIRE(cmds == full.cmds);
+  REQUIRE(slices > 20);
+
+  aml::code_n::stack_t small(1024, 100);
+  REQUIRE(execute(*bulk, std::vector<int64_t>{100}, small));
+  REQUIRE(execute(*bulk, std::vector<int64_t>{101}, small).error.find("capacity of 100") != std::string::npos);
+
+  // the arrays are mutable, their defns are not memoized
+  options_t options = {.input = code("(var a)"), .memoize = true};
+  auto program = compile_program(options);
+  REQUIRE(program);
+  REQUIRE(std::none_of(program->code.cmds.begin(), program->code.cmds.end(),
+        [](const auto& cmd) { return cmd.id == aml::code_n::cmd_id_t::memo; }));
+}
+
+
+
+TEST_CASE("batch") {
+  using namespace aml::aml_n;
+  // rows of uneven cost, every row is run once whichever worker takes or steals it
+  std::vector<std::atomic<size_t>> runs(10000);
+  aml::batch_n::process(runs.size(), 4, 16, [&](size_t /*worker*/, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (i < 100)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      runs[i]++;
+    }
+  });
+  REQUIRE(std::all_of(runs.begin(), runs.end(), [](const auto& count) { return count == 1; }));
+
+  // a single row is left unclaimed behind the slow grain of its owner, the idle worker steals it
+  aml::batch_n::queue_t victim;
+  aml::batch_n::queue_t thief;
+  victim.end = 1;
+  REQUIRE(thief.steal(victim));
+  REQUIRE(thief.end - thief.begin == 1);
+  REQUIRE(victim.begin == victim.end);
+  REQUIRE(!thief.steal(victim));
+
+  std::vector<std::atomic<size_t>> lone(129);
+  aml::batch_n::process(lone.size(), 2, 64, [&](size_t /*worker*/, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      std::this_thread::sleep_for(std::chrono::microseconds(i < 64 ? 1000 : 10));
+      lone[i]++;
+    }
+  });
+  REQUIRE(std::all_of(lone.begin(), lone.end(), [](const auto& count) { return count == 1; }));
+
+  options_t options = {
+    .input = R"AML(
+      (#include "aml/standard/standard.aml")
+      (defn fib
+        (if (call (func <) (arg 1) (int 2))
+          (arg 1)
+          (call (func +) (call (func fib) (call (func -) (arg 1) (int 1))) (call (func fib) (call (func -) (arg 1) (int 2))))))
+      (call (func -) (call (func fib) (arg 1)) (arg 2))
+    )AML",
+    .cmd = "compile",
+  };
+  auto program = compile_program(options);
+  REQUIRE(program);
+
+  std::vector<int64_t> rows;
+  for (int64_t i{}; i < 1000; ++i) {
+    rows.push_back(i % 20);
+    rows.push_back(i);
+  }
+  std::vector<result_t> results(1000);
+  execute_batch(*program, rows, 2, results, 4, 1024);
+  for (size_t i{}; i < results.size(); ++i) {
+    REQUIRE(results[i]);
+    REQUIRE(results[i].value == execute(*program, std::span(rows).subspan(i * 2, 2)).value);
+  }
+
+  // the cli streams rows from a file, a failed row is reported in its line
+  REQUIRE(run(options));
+  auto filename = (std::filesystem::temp_directory_path() / "aml_test_batch.rows").string();
+  aml::utils_n::str_to_file("10 5\n1 1\n100000 0\n", filename);
+  options_t options_batch = {
+    .input          = options.output,
+    .cmd            = "batch",
+    .rows           = filename,
+    .stack_capacity = 1024,
+    .jobs           = 2,
+  };
+  REQUIRE(run(options_batch));
+  REQUIRE(options_batch.output.starts_with("50\n0\nerror: "));
+  std::filesystem::remove(filename);
+}
+
+
+
+TEST_CASE("syntax error") {
+  using namespace aml::aml_n;
+  for (std::string code : {
+      "(call (defn test (int 1)))",
+      "(defn test (int 1)) (call (func test) ((int 1)))",
+      "(defn test (int 1 2)) (call (func test))"}) {
+    options_t options = {
+      .input = code,
+      .cmd   = "compile",
+    };
+    INFO("code: " << code);
+    REQUIRE(!run(options));
+    REQUIRE(options.errors.find("synax error") != std::string::npos);
+  }
+}
+
+TEST_CASE("stack overflow") {
+  using namespace aml::aml_n;
+  options_t options = {
+    .input = R"AML(
+      (defn test
+        (block
+          (call
+            (func test))
+          (int 0)))
+      (call
+        (func test))
+    )AML",
+  };
+
+  options.cmd = "compile";
+  REQUIRE(run(options));
+
+  options.input  = std::move(options.output);
+  options.output = {};
+  options.cmd    = "execute";
+  options.stack_capacity = 64;
+  REQUIRE(!run(options));
+  REQUIRE(options.errors.find("stack overflow") != std::string::npos);
+}
+
+
+
 #if 0
 TEST_CASE("files") {
   using namespace aml::aml_n;
@@ -265,12 +1332,40 @@ TEST_CASE("files") {
 
 
 
+TEST_CASE("lexer") {
+  using namespace aml::token_n;
+  symbols_t symbols;
+  std::string code = "(if iff int integer 12 -3 12ab - #include \"a b\") ; (x\n  arg1 iff";
+  auto tokens = process(code, symbols);
+
+  std::vector<type_t> types;
+  for (const auto& token : tokens) types.push_back(token.type);
+  REQUIRE(types == std::vector<type_t>{
+      type_t::lp, type_t::key_if, type_t::ident, type_t::key_int, type_t::ident, type_t::integer,
+      type_t::integer, type_t::ident, type_t::ident, type_t::key_include, type_t::dq_string, type_t::rp,
+      type_t::ident, type_t::ident});
+
+  REQUIRE(std::get<int64_t>(tokens[6].value) == -3);
+  REQUIRE(std::get<std::string_view>(tokens[10].value) == "a b");
+  REQUIRE(tokens[12].pos.show() == "2:3:4");
+  REQUIRE(std::get<symbol_t>(tokens[13].value) == std::get<symbol_t>(tokens[2].value));
+  REQUIRE(std::get<symbol_t>(tokens[13].value).name == "iff");
+  REQUIRE(symbols.names.size() == 5);
+  REQUIRE_THROWS(process("(int 1) \"a", symbols));
+}
+
+
+
 TEST_CASE("zigzag") {
   for (int64_t i = -1000; i < 1000; ++i) {
     int64_t a = aml::code_n::zigzag_encode(i);
     int64_t b = aml::code_n::zigzag_decode(a);
     REQUIRE(i == b);
   }
+  for (int64_t i : {std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::min() + 1,
+        std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::max() - 1}) {
+    REQUIRE(aml::code_n::zigzag_decode(aml::code_n::zigzag_encode(i)) == i);
+  }
 }
 
 TEST_CASE("zigzag size") {